@@ -24,6 +24,15 @@
 #include "types.h"
 #include "version.h"
 
+/*
+ * Module functions are called from the main thread, except for the render
+ * functions of modules with MFLAG_THREAD_SAFE, which may be called from
+ * worker threads for different blocks and bars at the same time. The main
+ * thread waits for them to return, so they never run alongside any other
+ * module function. They must not call blockbar_set_env or change state that
+ * is shared between calls; the functions below are otherwise safe to call.
+ */
+
 void blockbar_query_blocks(struct block **blocks, int *block_count);
 
 struct bar_settings *blockbar_get_settings();
@@ -58,13 +58,23 @@ struct bar_settings {
     struct setting trayiconsize;
     struct setting traybar;
     struct setting trayside;
+    struct setting schedule;
+    struct setting timerslack;
+    struct setting maxprocs;
+    struct setting threads;
 };
 
 struct properties {
     struct setting module;
     struct setting exec;
+    struct setting shell;
     struct setting pos;
     struct setting interval;
+    struct setting schedule;
+    struct setting persist;
+    struct setting overlap;
+    struct setting timeout;
+    struct setting maxoutput;
     struct setting padding;
     struct setting paddingleft;
     struct setting paddingright;
@@ -79,12 +89,16 @@ struct block_data {
 struct block {
     int id;
     int eachmon;
+    int shared;
     int task;
 
     int *width;
     int *x;
+    int *dirty;
     cairo_surface_t **sfc;
 
+    char **argv;
+
     struct properties properties;
     struct block_data *data;
 };
@@ -96,6 +110,8 @@ struct click {
 };
 
 #define MFLAG_NO_EXEC (1<<0)
+#define MFLAG_RENDER_EACHMON (1<<1)
+#define MFLAG_THREAD_SAFE (1<<2)
 
 enum module_type {
     BLOCK,
@@ -123,6 +139,8 @@ struct module {
     struct module_data data;
 
     cairo_surface_t **sfc;
+    int *x;
+    int *width;
     int zindex;
     int timePassed;
 };
@@ -20,6 +20,6 @@
 #ifndef VERSION_H
 #define VERSION_H
 
-const int API_VERSION = 1;
+const int API_VERSION = 3;
 
 #endif /* VERSION_H */
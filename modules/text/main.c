@@ -23,6 +23,7 @@ static void setup_font()
 int init(struct module_data *data)
 {
 	data->name = "text";
+	data->flags = MFLAG_THREAD_SAFE;
 
 	setup_font();
 
@@ -26,12 +26,159 @@
 #include <sys/un.h>
 #include <unistd.h>
 
-int main(int argc, char **argv)
+struct buffer {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static void append(struct buffer *buf, const char *data, size_t len)
+{
+	if (buf->len + len > buf->size) {
+		buf->size = (buf->len + len) * 2;
+		buf->data = realloc(buf->data, buf->size);
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+/*
+ * Appends the words of a line, each followed by a NUL byte. Words are split on
+ * whitespace, which is kept inside '' or "" or after a backslash. Inside "",
+ * \n is a newline. Returns the number of words, or -1 if a quote isn't closed.
+ */
+static int append_words(struct buffer *buf, const char *line)
+{
+	const char *p = line;
+	int words = 0;
+
+	while (1) {
+		while (*p == ' ' || *p == '\t' || *p == '\n') {
+			p++;
+		}
+
+		if (*p == 0 || *p == '#') {
+			break;
+		}
+
+		char quote = 0;
+
+		while (*p && (quote || !(*p == ' ' || *p == '\t' || *p == '\n'))) {
+			char c = *p++;
+
+			if (quote && c == quote) {
+				quote = 0;
+				continue;
+			} else if (!quote && (c == '\'' || c == '"')) {
+				quote = c;
+				continue;
+			} else if (c == '\\' && quote != '\'' && *p) {
+				c = *p++;
+
+				if (quote == '"' && c == 'n') {
+					c = '\n';
+				}
+			}
+
+			append(buf, &c, 1);
+		}
+
+		if (quote) {
+			return -1;
+		}
+
+		append(buf, "", 1);
+		words++;
+	}
+
+	return words;
+}
+
+static void append_frame(struct buffer *buf, int type, const char *data,
+		size_t len)
+{
+	char head [framehead] = {
+		type, len & 0xff, (len >> 8) & 0xff, (len >> 16) & 0xff, (len >> 24) & 0xff
+	};
+
+	append(buf, head, sizeof(head));
+	append(buf, data, len);
+}
+
+static size_t frame_length(const char *head)
+{
+	const unsigned char *h = (const unsigned char *) head;
+
+	return h[1] | h[2] << 8 | h[3] << 16 | (size_t) h[4] << 24;
+}
+
+/* Reads commands from stdin, one per line, into a single batch */
+static int read_batch(struct buffer *buf, const char *name)
+{
+	struct buffer words = {0};
+	char *line = 0;
+	size_t size = 0;
+	int n = 0;
+	int commands = 0;
+
+	while (getline(&line, &size, stdin) != -1) {
+		n++;
+		words.len = 0;
+
+		append(&words, name, strlen(name) + 1);
+
+		int count = append_words(&words, line);
+
+		if (count == -1) {
+			fprintf(stderr, "Unterminated quote on line %d\n", n);
+			free(line);
+			free(words.data);
+			return -1;
+		} else if (count == 0) {
+			continue;
+		}
+
+		append_frame(buf, framecmd, words.data, words.len);
+		commands++;
+	}
+
+	free(line);
+	free(words.data);
+
+	return commands;
+}
+
+/* Turns a framed request into one that servers from before version 2 read */
+static void unframe(struct buffer *msg, struct buffer *old)
+{
+	char sep [] = {nextcmd, 0};
+	int commands = 0;
+
+	for (size_t pos = 0; pos < msg->len;) {
+		char *data = msg->data + pos + framehead;
+		size_t len = frame_length(msg->data + pos);
+
+		if (msg->data[pos] == framecmd) {
+			if (commands++ > 0) {
+				append(old, sep, sizeof(sep));
+			}
+
+			append(old, data, len);
+		}
+
+		pos += framehead + len;
+	}
+
+	append(old, "\x04", 1);
+}
+
+static int connect_socket()
 {
 	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (sockfd < 0) {
 		fprintf(stderr, "Error opening socket\n");
-		return 1;
+		return -1;
 	}
 
 	char *socketpath = getenv("BLOCKBAR_SOCKET");
@@ -48,60 +195,226 @@ int main(int argc, char **argv)
 	if (connect(sockfd, (struct sockaddr *) &sock_addr, sizeof(sock_addr)) == -1) {
 		fprintf(stderr, "Error connecting to socket\n");
 		close(sockfd);
-		return 1;
+		return -1;
 	}
 
-	for (int i = 0; i < argc; i++) {
-		if (send(sockfd, argv[i], strlen(argv[i]) + 1, 0) == -1) {
+	return sockfd;
+}
+
+static int send_request(int sockfd, struct buffer *msg)
+{
+	for (size_t sent = 0; sent < msg->len;) {
+		ssize_t n = send(sockfd, msg->data + sent, msg->len - sent, 0);
+
+		if (n == -1) {
 			fprintf(stderr, "Error sending data\n");
-			close(sockfd);
 			return 1;
 		}
+
+		sent += n;
 	}
 
-	send(sockfd, "\x04", 1, 0);
+	return 0;
+}
+
+struct reply {
+	/* 0 until the server has said which version it replies with */
+	int version;
+	FILE *out;
+	int ret;
+
+	/* version 2 */
+	char head [framehead];
+	int head_len;
+	size_t left;
 
+	/* version 1, where a control byte and its argument may arrive in
+	 * different reads
+	 */
+	char ctl;
+};
+
+static void set_stream(struct reply *r, FILE *out)
+{
+	if (r->out != out) {
+		fflush(r->out);
+		r->out = out;
+	}
+}
+
+static void read_frames(struct reply *r, const char *buf, size_t n)
+{
+	for (size_t i = 0; i < n;) {
+		if (r->head_len < framehead) {
+			r->head[r->head_len++] = buf[i++];
+
+			if (r->head_len == framehead) {
+				r->left = frame_length(r->head);
+
+				if (r->head[0] == framestdout) {
+					set_stream(r, stdout);
+				} else if (r->head[0] == framestderr) {
+					set_stream(r, stderr);
+				}
+			}
+		} else {
+			size_t len = n - i < r->left ? n - i : r->left;
+
+			if (r->head[0] == framestdout || r->head[0] == framestderr) {
+				fwrite(buf + i, 1, len, r->out);
+			} else if (r->head[0] == frameret) {
+				r->ret = buf[i + len - 1];
+			}
+
+			i += len;
+			r->left -= len;
+		}
+
+		if (r->head_len == framehead && r->left == 0) {
+			r->head_len = 0;
+		}
+	}
+}
+
+static void read_unframed(struct reply *r, const char *buf, size_t n)
+{
+	size_t start = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		if (r->ctl == setout) {
+			if (buf[i] == rstdout) {
+				set_stream(r, stdout);
+			} else if (buf[i] == rstderr) {
+				set_stream(r, stderr);
+			}
+		} else if (r->ctl == setret) {
+			r->ret = buf[i];
+		} else if (buf[i] == setout || buf[i] == setret) {
+			fwrite(buf + start, 1, i - start, r->out);
+			r->ctl = buf[i];
+			continue;
+		} else {
+			continue;
+		}
+
+		r->ctl = 0;
+		start = i + 1;
+	}
+
+	if (!r->ctl) {
+		fwrite(buf + start, 1, n - start, r->out);
+	}
+}
+
+/* Prints the reply. Returns 1 if the server doesn't speak version 2. */
+static int read_reply(int sockfd, struct reply *r)
+{
 	struct pollfd fds [] = {
 		{sockfd, POLLIN, 0},
 		{STDOUT_FILENO, POLLHUP, 0},
 	};
 
-	FILE *out = stdout;
-	char rsp [bbcbuffsize];
-	int n, ret = 0;
+	static char rsp [1 << 16];
+	ssize_t n;
 
 	while (poll(fds, 2, -1) > 0) {
 		if (fds[1].revents & (POLLERR | POLLHUP)) {
 			break;
 		}
-		if (fds[0].revents & POLLIN) {
-			if ((n = recv(sockfd, rsp, sizeof(rsp), 0)) > 0) {
-				rsp[n] = 0;
-				for (int i = 0; i < n; i++) {
-					if (rsp[i] == setout) {
-						fflush(out);
-						if (rsp[i + 1] == rstdout) {
-							out = stdout;
-						} else if (rsp[i + 1] == rstderr) {
-							out = stderr;
-						}
-						i++;
-					} else if (rsp[i] == setret) {
-						ret = rsp[i + 1];
-						i++;
-					} else {
-						fprintf(out, "%c", rsp[i]);
-					}
-				}
-			} else {
-				break;
+
+		if (!(fds[0].revents & (POLLIN | POLLHUP))) {
+			continue;
+		}
+
+		if ((n = recv(sockfd, rsp, sizeof(rsp), 0)) <= 0) {
+			break;
+		}
+
+		if (r->version == 0) {
+			if (rsp[0] != framehello) {
+				return 1;
 			}
+
+			r->version = bbcversion;
+		}
+
+		if (r->version == 1) {
+			read_unframed(r, rsp, n);
+		} else {
+			read_frames(r, rsp, n);
 		}
+
+		/* events from "subscribe" are printed as they arrive */
+		fflush(r->out);
 	}
 
-	fflush(out);
+	fflush(r->out);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct buffer msg = {0};
+	char hello [sizeof(bbcmagic)];
+
+	memcpy(hello, bbcmagic, sizeof(bbcmagic) - 1);
+	hello[sizeof(bbcmagic) - 1] = bbcversion;
+	append_frame(&msg, framehello, hello, sizeof(hello));
+
+	if (argc == 2 && strcmp(argv[1], "--stdin") == 0) {
+		int commands = read_batch(&msg, argv[0]);
+
+		if (commands <= 0) {
+			free(msg.data);
+			return commands == 0 ? 0 : 1;
+		}
+	} else {
+		struct buffer args = {0};
+
+		for (int i = 0; i < argc; i++) {
+			append(&args, argv[i], strlen(argv[i]) + 1);
+		}
+
+		append_frame(&msg, framecmd, args.data, args.len);
+		free(args.data);
+	}
+
+	append_frame(&msg, frameend, "\x04", 1);
+
+	struct reply r = {0};
+	r.out = stdout;
+
+	int sockfd = connect_socket();
+
+	if (sockfd < 0 || send_request(sockfd, &msg) != 0) {
+		free(msg.data);
+		return 1;
+	}
+
+	/* a server from before version 2 gets the request again in its format */
+	if (read_reply(sockfd, &r) != 0) {
+		struct buffer old = {0};
+
+		close(sockfd);
+		unframe(&msg, &old);
+
+		sockfd = connect_socket();
+
+		if (sockfd < 0 || send_request(sockfd, &old) != 0) {
+			free(msg.data);
+			free(old.data);
+			return 1;
+		}
+
+		free(old.data);
+
+		r.version = 1;
+		read_reply(sockfd, &r);
+	}
 
+	free(msg.data);
 	close(sockfd);
 
-	return ret;
+	return r.ret;
 }
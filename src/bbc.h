@@ -23,9 +23,41 @@
 #define defsocketpath "/tmp/blockbar-socket"
 #define bbcbuffsize 1024
 
+/*
+ * Since version 2, requests and replies are made of frames: a type byte, the
+ * length of the frame's data as 4 bytes in little endian order, then the
+ * data. A request starts with a hello frame holding bbcmagic and the newest
+ * version the client speaks, has a command frame for each command, and is
+ * ended by an end frame holding \x04. The reply starts with a hello frame
+ * holding the version the server chose, then has stdout and stderr frames,
+ * and is ended by a frame holding the return code.
+ *
+ * A server from before version 2 stops reading at the \x04 and answers with
+ * an error in its own format, so the client knows to send the request again
+ * as version 1.
+ *
+ * A request that doesn't start with a hello frame is version 1: the arguments
+ * are each ended by a NUL byte, the request is ended by \x04, and the reply
+ * switches streams with setout and is ended by setret.
+ */
+#define bbcversion 2
+#define bbcmagic "bbc"
+
+#define framehead 5
+
+#define framehello 0x16
+#define framecmd 0x17
+#define frameend 0x18
+#define framestdout 0x19
+#define framestderr 0x1a
+#define frameret 0x1b
+
 #define setout 1
 #define setret 2
 
+/* separates the commands of a version 1 batch */
+#define nextcmd 3
+
 #define rstdout 1
 #define rstderr 2
 
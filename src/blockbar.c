@@ -18,12 +18,14 @@
  */
 
 #include "config.h"
+#include "event.h"
 #include "exec.h"
 #include "modules.h"
+#include "pool.h"
 #include "render.h"
 #include "socket.h"
 #include "task.h"
-#ifndef WAYLAND
+#if !defined(WAYLAND) && !defined(HEADLESS)
 #include "tray.h"
 #endif
 #include "window.h"
@@ -31,18 +33,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/time.h>
-#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
-#ifndef CLOCK_MONOTONIC_RAW
-#   define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
-#endif
-
-#define MAX(a, b) (a>b?a:b)
-
 int interval;
 
 static void print_usage(const char *file)
@@ -50,6 +44,39 @@ static void print_usage(const char *file)
 	fprintf(stderr, "Usage: %s [config_file]\n", file);
 }
 
+static void socket_ready(int fd, void *data)
+{
+	(void) data;
+
+	socket_accept(fd);
+}
+
+static void timer_ready(int fd, void *data)
+{
+	(void) fd;
+	(void) data;
+
+	tick_tasks();
+}
+
+static void child_ready(int fd, void *data)
+{
+	(void) fd;
+	(void) data;
+
+	reap_children();
+}
+
+#ifndef HEADLESS
+static void display_ready(int fd, void *data)
+{
+	(void) fd;
+	(void) data;
+
+	/* the events are read by poll_events, which runs after every wakeup */
+}
+#endif
+
 static void cleanup_blocks()
 {
 	for (int i = 0; i < block_count; i++) {
@@ -70,14 +97,17 @@ static void onexit()
 
 	exited = 1;
 
-#ifndef WAYLAND
+#if !defined(WAYLAND) && !defined(HEADLESS)
 	cleanup_tray();
 #endif
 	cleanup_blocks();
+	cleanup_exec();
 	cleanup_modules();
+	cleanup_render();
 	cleanup_bars();
 	cleanup_settings();
 	cleanup_tasks();
+	cleanup_events();
 
 	if (blocks) {
 		free(blocks);
@@ -109,6 +139,22 @@ int main(int argc, const char *argv[])
 		return 1;
 	}
 
+	if (event_init() != 0) {
+		return 1;
+	}
+
+	int timerfd = task_init();
+
+	if (timerfd == -1) {
+		return 1;
+	}
+
+	int childfd = exec_init();
+
+	if (childfd == -1) {
+		return 1;
+	}
+
 	if (create_bars() != 0) {
 		return 1;
 	}
@@ -119,9 +165,11 @@ int main(int argc, const char *argv[])
 		config_parse_general(json_config);
 	}
 
+	pool_init(settings.threads.val.INT);
+
 	update_geom();
 
-#ifndef WAYLAND
+#if !defined(WAYLAND) && !defined(HEADLESS)
 	if (!is_setting_modified(&settings.traybar)) {
 		tray_init(0);
 	}
@@ -142,118 +190,44 @@ int main(int argc, const char *argv[])
 
 	redraw();
 
-	struct timeval tv;
-	fd_set fds;
 #ifdef WAYLAND
 	int dispfd = wl_display_get_fd(disp);
-#else
+#elif !defined(HEADLESS)
 	int dispfd = ConnectionNumber(disp);
 #endif
 
-	while (1) {
-		FD_ZERO(&fds);
-		if (sockfd > 0) {
-			FD_SET(sockfd, &fds);
-		}
-		FD_SET(dispfd, &fds);
-
-		tv = get_time_to_next_task();
-
-		int nfds = MAX(dispfd, sockfd);
-		for (int i = 0; i < proc_count; i++) {
-			struct proc *proc = &procs[i];
-
-			if (proc->pid) {
-				FD_SET(proc->fdout, &fds);
-				if (proc->fdout > nfds) {
-					nfds = proc->fdout;
-				}
-			}
-		}
-
-		int fds_rdy = select(nfds + 1, &fds, 0, 0,
-				tv.tv_sec < 0 || tv.tv_usec < 0 ? 0 : &tv);
-
-		if (fds_rdy == -1) {
-			continue;
-		}
-
-		poll_events();
-
-		if (fds_rdy == 0) {
-			tick_tasks();
-
-			if (module_redraw_dirty) {
-				module_redraw_dirty = 0;
-				redraw();
-			}
+	if (sockfd > 0) {
+		event_add(sockfd, socket_ready, 0);
+	}
+#ifndef HEADLESS
+	event_add(dispfd, display_ready, 0);
+#endif
+	event_add(timerfd, timer_ready, 0);
+	event_add(childfd, child_ready, 0);
 
-			continue;
-		}
+	int display_dirty = 0;
 
-		if (FD_ISSET(sockfd, &fds)) {
-			socket_recv(sockfd);
+	while (1) {
+		if (event_wait(display_dirty ? 0 : -1) == -1) {
 			continue;
 		}
 
-		for (int i = 0; i < proc_count; i++) {
-			struct proc *proc = &procs[i];
-
-			if (proc->pid == 0) continue;
-			if (!FD_ISSET(proc->fdout, &fds)) continue;
-
-			char buf [2048] = {0};
-			int r = read(proc->fdout, buf, sizeof(buf) - 1);
-
-			if (r < 0) {
-				fprintf(stderr, "Error reading fdout\n");
-				continue;
-			}
-
-			if (!proc->buffer) {
-				proc->buffer = malloc(strlen(buf) + 1);
-				strcpy(proc->buffer, buf);
-			} else {
-				proc->buffer = realloc(proc->buffer,
-						strlen(proc->buffer) + strlen(buf) + 1);
-				strcpy(proc->buffer + strlen(proc->buffer), buf);
-			}
-
-			if (waitpid(proc->pid, 0, WNOHANG) == 0) continue;
-
-			struct block *blk = get_block(proc->blk);
-
-			if (blk) {
-				char **exec_data;
-				if (blk->eachmon) {
-					exec_data = &(blk->data[proc->bar].exec_data);
-				} else {
-					exec_data = &(blk->data->exec_data);
-				}
-
-				if (*exec_data) {
-					free(*exec_data);
-				}
-				*exec_data = proc->buffer;
-
-				if (strlen(*exec_data) &&
-						(*exec_data)[strlen(*exec_data) - 1] == '\n') {
-					(*exec_data)[strlen(*exec_data) - 1] = 0;
-				}
-
-				redraw_block(blk);
-			}
-
-			close(proc->fdout);
+		display_dirty |= poll_events();
 
-			proc->blk = 0;
-			proc->pid = 0;
-			proc->fdout = 0;
+		event_dispatch();
 
-			break;
+		if (exec_redraw_dirty || display_dirty || module_redraw_dirty) {
+			exec_redraw_dirty = 0;
+			display_dirty = 0;
+			module_redraw_dirty = 0;
+			redraw();
 		}
 
-		redraw();
+		/* redrawing and the callbacks can read events into the display's
+		 * queue without leaving it readable, so they are handled before
+		 * waiting again
+		 */
+		display_dirty = poll_events();
 	}
 
 	return 0;
@@ -18,8 +18,11 @@
  */
 
 #include "config.h"
+#include "exec.h"
 #include "modules.h"
-#ifndef WAYLAND
+#include "render.h"
+#include "task.h"
+#if !defined(WAYLAND) && !defined(HEADLESS)
 #include "tray.h"
 #endif
 #include "util.h"
@@ -79,13 +82,23 @@ struct bar_settings settings = {
 	S(trayiconsize, INT, "Width and height of each tray icon", 18)
 	S(traybar, STR, "Name of the output that the tray appears on", 0)
 	S(trayside, POS, "Position of the tray on the bar (\"left\" or \"right\")", RIGHT)
+	S(schedule, STR, "How repeating blocks are scheduled (\"relative\", \"absolute\" or \"aligned\")", "relative")
+	S(timerslack, INT, "Time in milliseconds that timers may be delayed by to share a wakeup", 0)
+	S(maxprocs, INT, "Maximum number of block commands that may run at once (0 for no limit)", 64)
+	S(threads, INT, "Number of threads that bars and blocks are rendered on (0 renders on the main thread only)", 0)
 };
 
 struct properties def_properties = {
 	S(module, STR, "The name of the module that handles the block", "text")
 	S(exec, STR, "Command to be executed", "")
+	S(shell, BOOL, "Runs the command with /bin/sh even if it has no shell syntax", 0)
 	S(pos, POS, "Position of the block", LEFT)
 	S(interval, INT, "Time in milliseconds between each execution of the block's script", 0)
+	S(schedule, STR, "Overrides the bar's \"schedule\" setting for the block", "")
+	S(persist, BOOL, "Keeps the block's command running and displays each line it outputs", 0)
+	S(overlap, STR, "What happens when the block is executed while its command is running (\"skip\", \"queue\" or \"replace\")", "queue")
+	S(timeout, INT, "Time in milliseconds after which the block's command is killed (0 for no timeout)", 0)
+	S(maxoutput, INT, "Maximum number of bytes of the block's output that are kept (0 for no limit)", 1048576)
 	S(padding, INT, "Additional padding on both sides of the block", 0)
 	S(paddingleft, INT, "Additional padding on the left of the block", 0)
 	S(paddingright, INT, "Additonal padding on the right of the block", 0)
@@ -108,8 +121,28 @@ struct bar_settings *blockbar_get_settings()
 	return &settings;
 }
 
+/* Returns nonzero if the setting changes how the bar's background, border or
+ * dividers look
+ */
+static int is_chrome_setting(struct setting *setting)
+{
+	return setting == &settings.height ||
+		setting == &settings.radius ||
+		setting == &settings.background ||
+		setting == &settings.borderwidth ||
+		setting == &settings.bordercolor ||
+		setting == &settings.divwidth ||
+		setting == &settings.divheight ||
+		setting == &settings.divvertmargin ||
+		setting == &settings.divcolor;
+}
+
 int set_setting(struct setting *setting, union value val)
 {
+	if (is_chrome_setting(setting)) {
+		invalidate_chrome();
+	}
+
 	switch (setting->type) {
 	case INT:
 	case BOOL:
@@ -123,7 +156,7 @@ int set_setting(struct setting *setting, union value val)
 			return 1;
 		}
 
-#ifndef WAYLAND
+#if !defined(WAYLAND) && !defined(HEADLESS)
 		if (setting == &settings.trayside && val.POS == CENTER) {
 			return 1;
 		}
@@ -140,7 +173,20 @@ int set_setting(struct setting *setting, union value val)
 			if (strcmp(val.STR, "top") && strcmp(val.STR, "bottom")) {
 				return 1;
 			}
-#ifndef WAYLAND
+		} else if (setting == &settings.schedule) {
+			if (parse_task_mode(val.STR) == -1) {
+				return 1;
+			}
+		} else if (setting->name == def_properties.schedule.name) {
+			/* blocks copy their properties from def_properties */
+			if (*val.STR && parse_task_mode(val.STR) == -1) {
+				return 1;
+			}
+		} else if (setting->name == def_properties.overlap.name) {
+			if (parse_overlap(val.STR) == -1) {
+				return 1;
+			}
+#if !defined(WAYLAND) && !defined(HEADLESS)
 		} else if (setting == &settings.traybar) {
 			int traybar = -1;
 			for (int i = 0; i < bar_count; i++) {
@@ -360,6 +406,7 @@ parse_blocks(JsonObject *jo, const char *key, enum pos pos, JsonError *err)
 		}
 
 		update_block_task(blk);
+		update_block_argv(blk);
 
 		blk->properties.pos.val.POS = pos;
 	}
@@ -0,0 +1,171 @@
+/* Copyright (C) 2018 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "event.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+
+struct event {
+	event_callback callback;
+	void *data;
+};
+
+static int epfd = -1;
+
+static struct event *events;
+static int event_count;
+
+static struct epoll_event ready [MAX_EVENTS];
+static int ready_count;
+
+int event_init()
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (epfd == -1) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	return 0;
+}
+
+int event_add(int fd, event_callback callback, void *data)
+{
+	if (fd < 0) {
+		return 1;
+	}
+
+	if (fd >= event_count) {
+		events = realloc(events, sizeof(struct event) * (fd + 1));
+		memset(events + event_count, 0,
+				sizeof(struct event) * (fd + 1 - event_count));
+		event_count = fd + 1;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return 1;
+	}
+
+	events[fd].callback = callback;
+	events[fd].data = data;
+
+	return 0;
+}
+
+int event_modify(int fd, int flags)
+{
+	if (fd < 0 || fd >= event_count || !events[fd].callback) {
+		return 1;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+
+	if (flags & EVENT_READ) {
+		ev.events |= EPOLLIN;
+	}
+
+	if (flags & EVENT_WRITE) {
+		ev.events |= EPOLLOUT;
+	}
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return 1;
+	}
+
+	return 0;
+}
+
+void event_remove(int fd)
+{
+	if (fd < 0 || fd >= event_count || !events[fd].callback) {
+		return;
+	}
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, 0);
+
+	events[fd].callback = 0;
+	events[fd].data = 0;
+
+	/* the fd may be reused before the pending events are dispatched */
+	for (int i = 0; i < ready_count; i++) {
+		if (ready[i].data.fd == fd) {
+			ready[i].data.fd = -1;
+		}
+	}
+}
+
+int event_wait(int timeout)
+{
+	ready_count = 0;
+
+	int n = epoll_wait(epfd, ready, MAX_EVENTS, timeout);
+
+	if (n == -1) {
+		return -1;
+	}
+
+	ready_count = n;
+
+	return n;
+}
+
+void event_dispatch()
+{
+	for (int i = 0; i < ready_count; i++) {
+		int fd = ready[i].data.fd;
+
+		if (fd < 0 || fd >= event_count || !events[fd].callback) {
+			continue;
+		}
+
+		events[fd].callback(fd, events[fd].data);
+	}
+
+	ready_count = 0;
+}
+
+void cleanup_events()
+{
+	if (epfd != -1) {
+		close(epfd);
+		epfd = -1;
+	}
+
+	if (events) {
+		free(events);
+		events = 0;
+	}
+
+	event_count = 0;
+}
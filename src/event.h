@@ -0,0 +1,36 @@
+/* Copyright (C) 2018 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#define EVENT_READ (1 << 0)
+#define EVENT_WRITE (1 << 1)
+
+typedef void (*event_callback)(int fd, void *data);
+
+int event_init();
+int event_add(int fd, event_callback callback, void *data);
+int event_modify(int fd, int flags);
+void event_remove(int fd);
+int event_wait(int timeout);
+void event_dispatch();
+void cleanup_events();
+
+#endif /* EVENT_H */
@@ -19,26 +19,114 @@
 
 #include "exec.h"
 #include "config.h"
+#include "event.h"
 #include "modules.h"
 #include "render.h"
+#include "socket.h"
+#include "task.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#define BACKOFF_MIN 1000
+#define BACKOFF_MAX 60000
+#define READ_SIZE 4096
+
+/* A long-running command of a block with "persist" set. The entry outlives
+ * the process, so that it can be restarted after it exits.
+ */
+struct producer {
+	int blk;
+	int bar;
+	int pid;
+	int task;
+	int backoff;
+	struct timeval started;
+};
+
 int proc_count;
 struct proc *procs;
 
+static int producer_count;
+static struct producer *producers;
+
+/* An execution that is waiting for the block's previous command to finish,
+ * or for another command to finish if "maxprocs" are already running.
+ */
+struct pending {
+	int blk;
+	int bar;
+	int clicked;
+	struct click cd;
+};
+
+static int pending_count;
+static struct pending *pending;
+
+int exec_redraw_dirty;
+
+/* outputs that were displayed and outputs that matched what was displayed */
+unsigned long exec_updates;
+unsigned long exec_unchanged;
+
+static int childfd = -1;
+
+extern char **environ;
+
+/* "KEY=value" strings that are added to the next child's environment */
 static int env_count = 0;
 static char **envs = 0;
 
+static int env_key_len(const char *env)
+{
+	return strchr(env, '=') - env;
+}
+
 void blockbar_set_env(const char *key, const char *val)
 {
+	int key_len = strlen(key);
+	char *env = malloc(key_len + strlen(val) + 2);
+
+	sprintf(env, "%s=%s", key, val);
+
+	for (int i = 0; i < env_count; i++) {
+		if (env_key_len(envs[i]) == key_len &&
+				strncmp(envs[i], key, key_len) == 0) {
+			free(envs[i]);
+			envs[i] = env;
+			return;
+		}
+	}
+
 	envs = realloc(envs, sizeof(char *) * ++env_count);
-	envs[env_count - 1] = malloc(strlen(key) + 1);
-	strcpy(envs[env_count - 1], key);
+	envs[env_count - 1] = env;
+}
+
+static int is_env_overridden(const char *env)
+{
+	char *eq = strchr(env, '=');
+
+	if (!eq) {
+		return 0;
+	}
+
+	for (int i = 0; i < env_count; i++) {
+		int len = env_key_len(envs[i]);
+
+		if (len == eq - env && strncmp(envs[i], env, len) == 0) {
+			return 1;
+		}
+	}
 
-	setenv(key, val, 1);
+	return 0;
 }
 
 static void reset_envs()
@@ -48,7 +136,6 @@ static void reset_envs()
 	}
 
 	for (int i = 0; i < env_count; i++) {
-		setenv(envs[i], "", 1);
 		free(envs[i]);
 	}
 
@@ -91,14 +178,648 @@ static void bar_envs(struct block *blk, int bar, struct click *cd)
 	}
 }
 
-static void execute(struct block *blk, int bar, struct click *cd)
+/* Returns 0 and frees data if it is the same as the block's current data */
+int set_exec_data(struct block *blk, int bar, char *data)
+{
+	char **exec_data;
+	if (blk->eachmon) {
+		exec_data = &(blk->data[bar].exec_data);
+	} else {
+		exec_data = &(blk->data->exec_data);
+	}
+
+	if (*exec_data && strcmp(*exec_data, data) == 0) {
+		free(data);
+		exec_unchanged++;
+		return 0;
+	}
+
+	if (*exec_data) {
+		free(*exec_data);
+	}
+	*exec_data = data;
+	exec_updates++;
+	notify_content(blk, bar);
+	return 1;
+}
+
+static struct producer *get_producer(int blk, int bar, int create)
+{
+	struct producer *p = 0;
+
+	for (int i = 0; i < producer_count; i++) {
+		if (producers[i].blk == blk && producers[i].bar == bar) {
+			return &producers[i];
+		}
+
+		if (producers[i].blk == 0 && p == 0) {
+			p = &producers[i];
+		}
+	}
+
+	if (!create) {
+		return 0;
+	}
+
+	if (p == 0) {
+		producers = realloc(producers,
+				sizeof(struct producer) * ++producer_count);
+		p = &producers[producer_count - 1];
+	}
+
+	memset(p, 0, sizeof(struct producer));
+	p->blk = blk;
+	p->bar = bar;
+
+	return p;
+}
+
+int parse_overlap(const char *str)
+{
+	if (strcmp(str, "skip") == 0) {
+		return OVERLAP_SKIP;
+	} else if (strcmp(str, "queue") == 0) {
+		return OVERLAP_QUEUE;
+	} else if (strcmp(str, "replace") == 0) {
+		return OVERLAP_REPLACE;
+	}
+
+	return -1;
+}
+
+static void close_fds(struct proc *proc)
+{
+	if (proc->fdout >= 0) {
+		event_remove(proc->fdout);
+		close(proc->fdout);
+	}
+
+	if (proc->fdin > 0) {
+		close(proc->fdin);
+	}
+
+	if (proc->buffer) {
+		free(proc->buffer);
+	}
+
+	proc->fdout = -1;
+	proc->fdin = -1;
+	proc->buffer = 0;
+	proc->len = 0;
+	proc->size = 0;
+}
+
+static void close_proc(struct proc *proc)
+{
+	if (proc->task) {
+		cancel_task(proc->task);
+	}
+
+	close_fds(proc);
+
+	memset(proc, 0, sizeof(struct proc));
+}
+
+/* Kills a child and everything in its process group, and discards its output,
+ * leaving the block's text as it was. The entry is freed by reap_children once
+ * the child has exited, so that a child which is stuck in the kernel keeps
+ * counting towards "maxprocs".
+ */
+static void kill_proc(struct proc *proc)
+{
+	kill(-proc->pid, SIGKILL);
+
+	if (proc->task) {
+		cancel_task(proc->task);
+		proc->task = 0;
+	}
+
+	close_fds(proc);
+
+	proc->killed = 1;
+}
+
+static int running_count()
+{
+	int count = 0;
+
+	for (int i = 0; i < proc_count; i++) {
+		if (procs[i].pid && !procs[i].persist) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static struct proc *get_running(int blk, int bar)
+{
+	for (int i = 0; i < proc_count; i++) {
+		struct proc *proc = &procs[i];
+
+		if (proc->pid && !proc->persist && !proc->killed &&
+				proc->blk == blk && proc->bar == bar) {
+			return proc;
+		}
+	}
+
+	return 0;
+}
+
+static void run_pending();
+
+static void proc_timeout(int id)
+{
+	for (int i = 0; i < proc_count; i++) {
+		struct proc *proc = &procs[i];
+
+		if (!proc->pid || proc->task != id) {
+			continue;
+		}
+
+		proc->task = 0;
+
+		fprintf(stderr, "Block %d timed out\n", proc->blk);
+		kill_proc(proc);
+		break;
+	}
+}
+
+static void producer_restart(int id);
+
+/* Restarts a producer after a delay, which doubles each time it fails
+ * again soon after starting
+ */
+static void schedule_restart(struct producer *p, time_t lifetime)
+{
+	if (lifetime * 1000 >= BACKOFF_MAX || p->backoff == 0) {
+		p->backoff = BACKOFF_MIN;
+	} else if (p->backoff * 2 <= BACKOFF_MAX) {
+		p->backoff *= 2;
+	} else {
+		p->backoff = BACKOFF_MAX;
+	}
+
+	p->pid = 0;
+	p->task = schedule_task(producer_restart, p->backoff, 0, TASK_RELATIVE);
+}
+
+static void producer_exited(struct proc *proc, int reaped)
+{
+	int pid = proc->pid;
+	struct producer *p = get_producer(proc->blk, proc->bar, 0);
+
+	if (reaped) {
+		close_proc(proc);
+	} else {
+		/* stdout was closed, so the output is lost anyway */
+		kill_proc(proc);
+	}
+
+	if (!p || p->pid != pid) {
+		return;
+	}
+
+	struct timeval now, lifetime;
+	get_time(&now);
+	timersub(&now, &p->started, &lifetime);
+
+	schedule_restart(p, lifetime.tv_sec);
+}
+
+/* Makes room for at least READ_SIZE more bytes, unless the block's
+ * "maxoutput" has been reached. Returns the number of bytes available.
+ */
+static int proc_reserve(struct proc *proc)
+{
+	struct block *blk = get_block(proc->blk);
+	int max = blk ? blk->properties.maxoutput.val.INT : 0;
+
+	if (max > 0 && proc->len >= max) {
+		return 0;
+	}
+
+	if (proc->size - proc->len - 1 < READ_SIZE) {
+		int size = proc->size ? proc->size * 2 : READ_SIZE * 2;
+
+		while (size - proc->len - 1 < READ_SIZE) {
+			size *= 2;
+		}
+
+		if (max > 0 && size > max + 1) {
+			size = max + 1;
+		}
+
+		proc->buffer = realloc(proc->buffer, size);
+		proc->size = size;
+	}
+
+	return proc->size - proc->len - 1;
+}
+
+/* Appends everything that can be read from the child's stdout to its buffer,
+ * discarding anything beyond the block's "maxoutput".
+ * Returns 1 once the pipe has been closed, or 0 if it would block.
+ */
+static int proc_fill(struct proc *proc)
+{
+	while (1) {
+		char discard [READ_SIZE];
+		char *dst = discard;
+		int avail = proc_reserve(proc);
+
+		if (avail > 0) {
+			dst = proc->buffer + proc->len;
+		} else {
+			avail = sizeof(discard);
+		}
+
+		int r = read(proc->fdout, dst, avail);
+
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (r < 0 && errno == EAGAIN) {
+			return 0;
+		}
+
+		if (r <= 0) {
+			return 1;
+		}
+
+		if (dst == discard) {
+			if (!proc->truncated) {
+				fprintf(stderr, "Output of block %d was truncated\n",
+						proc->blk);
+				proc->truncated = 1;
+			}
+			continue;
+		}
+
+		proc->len += r;
+	}
+}
+
+/* Returns a copy of len bytes of output, without any NUL bytes in it */
+static char *copy_output(const char *str, int len)
+{
+	char *data = malloc(len + 1);
+	int n = 0;
+
+	for (const char *c = str; c < str + len;) {
+		const char *nul = memchr(c, 0, str + len - c);
+		int l = nul ? nul - c : str + len - c;
+
+		memcpy(data + n, c, l);
+		n += l;
+		c += l + 1;
+	}
+
+	data[n] = 0;
+	return data;
+}
+
+/* Displays the last complete line that a persistent command has output */
+static void proc_lines(struct proc *proc)
+{
+	int end = proc->len - 1;
+
+	while (end >= 0 && proc->buffer[end] != '\n') {
+		end--;
+	}
+
+	if (end < 0) {
+		/* a line longer than "maxoutput" can never be completed */
+		if (proc->size && proc_reserve(proc) == 0) {
+			proc->len = 0;
+		}
+		return;
+	}
+
+	int start = end;
+
+	while (start > 0 && proc->buffer[start - 1] != '\n') {
+		start--;
+	}
+
+	struct block *blk = get_block(proc->blk);
+
+	if (blk && set_exec_data(blk, proc->bar,
+				copy_output(proc->buffer + start, end - start))) {
+		redraw_block(blk);
+		exec_redraw_dirty = 1;
+	}
+
+	proc->len -= end + 1;
+	memmove(proc->buffer, proc->buffer + end + 1, proc->len);
+}
+
+static void proc_commit(struct proc *proc)
+{
+	struct block *blk = get_block(proc->blk);
+
+	if (blk) {
+		int len = proc->len;
+
+		if (len && proc->buffer[len - 1] == '\n') {
+			len--;
+		}
+
+		char *exec_data;
+
+		if (proc->buffer && !memchr(proc->buffer, 0, len)) {
+			exec_data = realloc(proc->buffer, len + 1);
+			exec_data[len] = 0;
+			proc->buffer = 0;
+		} else {
+			exec_data = copy_output(proc->buffer, len);
+		}
+
+		if (set_exec_data(blk, proc->bar, exec_data)) {
+			redraw_block(blk);
+			exec_redraw_dirty = 1;
+		}
+	}
+
+	close_proc(proc);
+}
+
+static void proc_read(int fd, void *data)
+{
+	struct proc *proc = &procs[(long) data];
+	int closed = proc_fill(proc);
+
+	if (proc->persist) {
+		proc_lines(proc);
+
+		if (closed) {
+			producer_exited(proc, 0);
+		}
+	} else if (closed) {
+		/* the output is committed once the child has been reaped */
+		event_remove(fd);
+		close(fd);
+		proc->fdout = -1;
+	}
+}
+
+int exec_init()
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+
+	/* children are reaped from the event loop, rather than a handler */
+	if (sigprocmask(SIG_BLOCK, &mask, 0) == -1) {
+		perror("sigprocmask");
+		return -1;
+	}
+
+	childfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	if (childfd == -1) {
+		perror("signalfd");
+	}
+
+	return childfd;
+}
+
+void reap_children()
+{
+	struct signalfd_siginfo info;
+
+	/* SIGCHLD isn't queued per child, so every child is checked */
+	while (read(childfd, &info, sizeof(info)) > 0);
+
+	for (int i = 0; i < proc_count; i++) {
+		struct proc *proc = &procs[i];
+
+		if (!proc->pid || waitpid(proc->pid, 0, WNOHANG) == 0) {
+			continue;
+		}
+
+		if (proc->killed) {
+			memset(proc, 0, sizeof(struct proc));
+			continue;
+		}
+
+		/* anything the child wrote before exiting is already in the pipe */
+		if (proc->fdout >= 0) {
+			proc_fill(proc);
+		}
+
+		if (proc->persist) {
+			proc_lines(proc);
+			producer_exited(proc, 1);
+		} else {
+			proc_commit(proc);
+		}
+	}
+
+	run_pending();
+}
+
+static int cloexec_pipe(int fds [2])
+{
+	if (pipe(fds) == -1) {
+		return -1;
+	}
+
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+static const char shell_chars [] = "|&;<>()$`\\\"'*?[]\n";
+
+/* Returns nonzero if splitting cmd at blanks wouldn't run it the way the
+ * shell does. Some characters are only special at the start of a word, and
+ * the first word may be an assignment or the ! keyword.
+ */
+static int needs_shell(const char *cmd)
+{
+	if (strpbrk(cmd, shell_chars)) {
+		return 1;
+	}
+
+	int first = 1;
+
+	for (const char *c = cmd; *c; c++) {
+		if (*c == ' ' || *c == '\t') {
+			continue;
+		}
+
+		if (*c == '~' || *c == '#') {
+			return 1;
+		}
+
+		const char *word = c;
+
+		while (c[1] && c[1] != ' ' && c[1] != '\t') {
+			c++;
+		}
+
+		if (!first) {
+			continue;
+		}
+
+		first = 0;
+
+		if (*word == '!' && word == c) {
+			return 1;
+		}
+
+		if (*word == '_' || isalpha((unsigned char) *word)) {
+			const char *n = word + 1;
+
+			while (*n == '_' || isalnum((unsigned char) *n)) {
+				n++;
+			}
+
+			if (*n == '=') {
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void update_block_argv(struct block *blk)
+{
+	if (blk->argv) {
+		free(blk->argv);
+		blk->argv = 0;
+	}
+
+	char *cmd = blk->properties.exec.val.STR;
+
+	if (!cmd || !*cmd) {
+		return;
+	}
+
+	if (blk->properties.shell.val.BOOL || needs_shell(cmd)) {
+		blk->argv = malloc(sizeof(char *) * 4 + strlen(cmd) + 1);
+		blk->argv[0] = "/bin/sh";
+		blk->argv[1] = "-c";
+		blk->argv[2] = (char *) (blk->argv + 4);
+		blk->argv[3] = 0;
+		strcpy(blk->argv[2], cmd);
+		return;
+	}
+
+	int argc = 0;
+
+	for (char *c = cmd; *c; c++) {
+		if (*c != ' ' && *c != '\t' && (c == cmd || c[-1] == ' ' ||
+					c[-1] == '\t')) {
+			argc++;
+		}
+	}
+
+	if (argc == 0) {
+		return;
+	}
+
+	/* the pointers and the split copy of the command share one allocation */
+	blk->argv = malloc(sizeof(char *) * (argc + 1) + strlen(cmd) + 1);
+
+	char *str = (char *) (blk->argv + argc + 1);
+	strcpy(str, cmd);
+
+	argc = 0;
+
+	for (char *tok = strtok(str, " \t"); tok; tok = strtok(0, " \t")) {
+		blk->argv[argc++] = tok;
+	}
+
+	blk->argv[argc] = 0;
+}
+
+/* Runs argv with the pending environment, without copying the parent's page
+ * tables. The child is placed in a new process group, so that anything it
+ * starts is killed along with it.
+ */
+static int spawn(char **argv, int fdout, int fdin, pid_t *pid)
+{
+	int environ_count = 0;
+	while (environ[environ_count]) {
+		environ_count++;
+	}
+
+	char *envp [environ_count + env_count + 1];
+	int envc = 0;
+
+	for (int i = 0; i < environ_count; i++) {
+		if (!is_env_overridden(environ[i])) {
+			envp[envc++] = environ[i];
+		}
+	}
+
+	for (int i = 0; i < env_count; i++) {
+		envp[envc++] = envs[i];
+	}
+
+	envp[envc] = 0;
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fdout, STDOUT_FILENO);
+
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+
+	sigset_t sigdef;
+	sigemptyset(&sigdef);
+	sigaddset(&sigdef, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigdef);
+
+	/* SIGCHLD is blocked in blockbar, see exec_init */
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+
+	if (fdin != -1) {
+		posix_spawn_file_actions_adddup2(&actions, fdin, STDIN_FILENO);
+	}
+
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+			POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+	int err = posix_spawnp(pid, argv[0], &actions, &attr, argv, envp);
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	return err;
+}
+
+static long execute(struct block *blk, int bar, struct click *cd, int persist)
 {
+	long index = -1;
+
 	char blockid [12] = {0};
 	sprintf(blockid, "%d", blk->id);
 	blockbar_set_env("BLOCK_ID", blockid);
 
 	bar_envs(blk, bar, cd);
 
+	if (!persist) {
+		char button [12] = {0};
+		char clickx [12] = {0};
+
+		if (cd != 0) {
+			sprintf(button, "%d", cd->button);
+			sprintf(clickx, "%d", cd->x + bars[cd->bar].x);
+		}
+
+		blockbar_set_env("BLOCK_BUTTON", button);
+		blockbar_set_env("CLICK_X", clickx);
+	}
+
 	struct module *mod = get_module_by_name(blk->properties.module.val.STR);
 
 	if (mod) {
@@ -115,54 +836,326 @@ static void execute(struct block *blk, int bar, struct click *cd)
 	}
 
 	int out [2];
+	int in [2] = {-1, -1};
 
-	if (pipe(out) == -1) {
+	if (cloexec_pipe(out) == -1) {
 		fprintf(stderr, "Failed to create pipe\n");
-		return;
+		goto end;
 	}
 
-	int pid = fork();
-	if (pid == -1) {
-		fprintf(stderr, "Failed to fork\n");
-		return;
-	}
-
-	if (pid == 0) {
+	if (persist && cloexec_pipe(in) == -1) {
+		fprintf(stderr, "Failed to create pipe\n");
 		close(out[0]);
+		close(out[1]);
+		goto end;
+	}
 
-		dup2(out[1], STDOUT_FILENO);
+	if (!blk->argv) {
+		update_block_argv(blk);
+	}
 
+	if (!blk->argv) {
+		close(out[0]);
 		close(out[1]);
+		if (persist) {
+			close(in[0]);
+			close(in[1]);
+		}
+		goto end;
+	}
 
-		char *shell = "/bin/sh";
-		execl(shell, shell, "-c", blk->properties.exec.val.STR,
-				(char *) 0);
+	pid_t pid;
+	int err = spawn(blk->argv, out[1], in[0], &pid);
+
+	/* the first word may be a shell builtin, such as "exec" */
+	if (err == ENOENT && strcmp(blk->argv[0], "/bin/sh")) {
+		char *argv [] = {"/bin/sh", "-c", blk->properties.exec.val.STR, 0};
+		err = spawn(argv, out[1], in[0], &pid);
 	}
 
 	close(out[1]);
 
-	struct proc *proc = 0;
+	if (persist) {
+		close(in[0]);
+	}
+
+	if (err) {
+		fprintf(stderr, "Failed to spawn: %s\n", strerror(err));
+		close(out[0]);
+		if (persist) {
+			close(in[1]);
+		}
+		goto end;
+	}
+
+	if (persist) {
+		fcntl(in[1], F_SETFL, O_NONBLOCK);
+	}
+
+	fcntl(out[0], F_SETFL, O_NONBLOCK);
+
 	for (int i = 0; i < proc_count; i++) {
 		if (procs[i].pid == 0) {
-			proc = &procs[i];
+			index = i;
 			break;
 		}
 	}
 
-	if (proc == 0) {
+	if (index == -1) {
 		proc_count++;
 		procs = realloc(procs, sizeof(struct proc) * proc_count);
-		proc = &procs[proc_count - 1];
+		index = proc_count - 1;
 	}
 
+	struct proc *proc = &procs[index];
+
 	proc->fdout = out[0];
+	proc->fdin = in[1];
 	proc->pid = pid;
 	proc->blk = blk->id;
 	proc->bar = bar;
+	proc->persist = persist;
+	proc->task = 0;
+	proc->killed = 0;
+	proc->truncated = 0;
 	proc->buffer = 0;
+	proc->len = 0;
+	proc->size = 0;
+
+	if (!persist && blk->properties.timeout.val.INT > 0) {
+		proc->task = schedule_task(proc_timeout,
+				blk->properties.timeout.val.INT, 0, TASK_RELATIVE);
+	}
+
+	event_add(proc->fdout, proc_read, (void *) index);
 
 end:
 	reset_envs();
+
+	return index;
+}
+
+static void producer_start(struct block *blk, int bar)
+{
+	struct producer *p = get_producer(blk->id, bar, 1);
+
+	if (p->task) {
+		cancel_task(p->task);
+		p->task = 0;
+	}
+
+	long index = execute(blk, bar, 0, 1);
+
+	if (index == -1) {
+		/* e.g. no pipe could be made, which is supervised like a crash */
+		schedule_restart(p, 0);
+		return;
+	}
+
+	p->pid = procs[index].pid;
+	get_time(&p->started);
+}
+
+static void producer_restart(int id)
+{
+	for (int i = 0; i < producer_count; i++) {
+		struct producer *p = &producers[i];
+
+		if (!p->blk || p->task != id) {
+			continue;
+		}
+
+		p->task = 0;
+
+		struct block *blk = get_block(p->blk);
+
+		if (!blk || !blk->properties.persist.val.BOOL) {
+			p->blk = 0;
+			return;
+		}
+
+		producer_start(blk, p->bar);
+		return;
+	}
+}
+
+static void producer_click(struct block *blk, struct click *cd)
+{
+	int bar = blk->eachmon ? cd->bar : 0;
+	struct producer *p = get_producer(blk->id, bar, 0);
+
+	if (!p || !p->pid) {
+		/* one that is backing off is left to be restarted by its task */
+		if (p && p->task) {
+			return;
+		}
+
+		producer_start(blk, bar);
+		p = get_producer(blk->id, bar, 0);
+
+		/* the click waits in the pipe until the new process reads it */
+		if (!p || !p->pid) {
+			return;
+		}
+	}
+
+	for (int i = 0; i < proc_count; i++) {
+		struct proc *proc = &procs[i];
+
+		if (proc->pid != p->pid) {
+			continue;
+		}
+
+		char line [32];
+		int len = snprintf(line, sizeof(line), "%d %d\n",
+				cd->button, cd->x + bars[cd->bar].x);
+
+		if (write(proc->fdin, line, len) != len) {
+			fprintf(stderr, "Failed to send click to block %d\n",
+					blk->id);
+		}
+
+		break;
+	}
+}
+
+static void block_exec_persist(struct block *blk, struct click *cd)
+{
+	if (cd) {
+		producer_click(blk, cd);
+		return;
+	}
+
+	int count = blk->eachmon ? bar_count : 1;
+
+	for (int bar = 0; bar < count; bar++) {
+		struct producer *p = get_producer(blk->id, bar, 0);
+
+		if (p && p->pid) {
+			continue;
+		}
+
+		if (p) {
+			p->backoff = 0;
+		}
+
+		producer_start(blk, bar);
+	}
+}
+
+void block_kill(struct block *blk)
+{
+	for (int i = 0; i < producer_count; i++) {
+		struct producer *p = &producers[i];
+
+		if (p->blk != blk->id) {
+			continue;
+		}
+
+		if (p->task) {
+			cancel_task(p->task);
+		}
+
+		memset(p, 0, sizeof(struct producer));
+	}
+
+	for (int i = 0; i < proc_count; i++) {
+		struct proc *proc = &procs[i];
+
+		if (proc->pid && !proc->killed && proc->blk == blk->id) {
+			kill_proc(proc);
+		}
+	}
+
+	for (int i = 0; i < pending_count; i++) {
+		if (pending[i].blk == blk->id) {
+			memmove(&pending[i], &pending[i + 1],
+					sizeof(struct pending) * (pending_count - i - 1));
+			pending_count--;
+			i--;
+		}
+	}
+}
+
+static void queue_exec(struct block *blk, int bar, struct click *cd)
+{
+	struct pending *p = 0;
+
+	for (int i = 0; i < pending_count; i++) {
+		if (pending[i].blk == blk->id && pending[i].bar == bar) {
+			p = &pending[i];
+			break;
+		}
+	}
+
+	if (!p) {
+		pending = realloc(pending, sizeof(struct pending) * ++pending_count);
+		p = &pending[pending_count - 1];
+		memset(p, 0, sizeof(struct pending));
+		p->blk = blk->id;
+		p->bar = bar;
+	}
+
+	/* a click is kept over a later execution without one */
+	if (cd) {
+		p->clicked = 1;
+		p->cd = *cd;
+	}
+}
+
+static int at_limit()
+{
+	int max = settings.maxprocs.val.INT;
+
+	return max > 0 && running_count() >= max;
+}
+
+static void run_pending()
+{
+	for (int i = 0; i < pending_count && !at_limit(); i++) {
+		struct pending p = pending[i];
+		struct block *blk = get_block(p.blk);
+
+		if (blk && get_running(p.blk, p.bar)) {
+			continue;
+		}
+
+		memmove(&pending[i], &pending[i + 1],
+				sizeof(struct pending) * (pending_count - i - 1));
+		pending_count--;
+		i--;
+
+		/* the bar may have been removed while the execution was queued */
+		if (blk && p.bar < bar_count &&
+				(!p.clicked || p.cd.bar < bar_count)) {
+			execute(blk, p.bar, p.clicked ? &p.cd : 0, 0);
+		}
+	}
+}
+
+static void exec_bar(struct block *blk, int bar, struct click *cd)
+{
+	struct proc *running = get_running(blk->id, bar);
+
+	if (running) {
+		int overlap = parse_overlap(blk->properties.overlap.val.STR);
+
+		if (overlap == OVERLAP_SKIP) {
+			return;
+		} else if (overlap == OVERLAP_QUEUE) {
+			queue_exec(blk, bar, cd);
+			return;
+		}
+
+		kill_proc(running);
+	}
+
+	if (at_limit()) {
+		queue_exec(blk, bar, cd);
+		return;
+	}
+
+	execute(blk, bar, cd, 0);
 }
 
 void block_exec(struct block *blk, struct click *cd)
@@ -182,34 +1175,43 @@ void block_exec(struct block *blk, struct click *cd)
 		return;
 	}
 
-	char button [12] = {0};
-	char clickx [12] = {0};
-
-	if (cd != 0) {
-		sprintf(button, "%d", cd->button);
-		sprintf(clickx, "%d", cd->x + bars[cd->bar].x);
+	if (blk->properties.persist.val.BOOL) {
+		block_exec_persist(blk, cd);
+		return;
 	}
 
-	blockbar_set_env("BLOCK_BUTTON", button);
-	blockbar_set_env("CLICK_X", clickx);
-
 	if (blk->eachmon) {
 		if (cd) {
-			execute(blk, cd->bar, cd);
+			exec_bar(blk, cd->bar, cd);
 
 			for (int i = 0; i < bar_count; i++) {
 				if (i == cd->bar) {
 					continue;
 				}
 
-				execute(blk, i, 0);
+				exec_bar(blk, i, 0);
 			}
 		} else {
 			for (int i = 0; i < bar_count; i++) {
-				execute(blk, i, 0);
+				exec_bar(blk, i, 0);
 			}
 		}
 	} else {
-		execute(blk, 0, cd);
+		exec_bar(blk, 0, cd);
+	}
+}
+
+void cleanup_exec()
+{
+	if (childfd != -1) {
+		close(childfd);
+	}
+
+	if (producers) {
+		free(producers);
+	}
+
+	if (pending) {
+		free(pending);
 	}
 }
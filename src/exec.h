@@ -28,12 +28,36 @@ struct proc {
 	int bar;
 	int pid;
 	int fdout;
+	int fdin;
+	int persist;
+	int task;
+	int killed;
+	int truncated;
 	char *buffer;
+	int len;
+	int size;
+};
+
+enum overlap {
+	OVERLAP_SKIP,
+	OVERLAP_QUEUE,
+	OVERLAP_REPLACE
 };
 
 extern int proc_count;
 extern struct proc *procs;
 
+extern int exec_redraw_dirty;
+extern unsigned long exec_updates;
+extern unsigned long exec_unchanged;
+
+int exec_init();
+void reap_children();
+int parse_overlap(const char *str);
+int set_exec_data(struct block *blk, int bar, char *data);
+void update_block_argv(struct block *blk);
 void block_exec(struct block *blk, struct click *cd);
+void block_kill(struct block *blk);
+void cleanup_exec();
 
 #endif /* EXEC_H */
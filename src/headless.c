@@ -0,0 +1,206 @@
+/* Copyright (C) 2018 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "window.h"
+#include "config.h"
+#include "modules.h"
+#include "render.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int bar_count;
+struct bar *bars;
+
+static const char *dump_dir;
+static int dump_raw;
+
+/* Creates a bar for each output in $BLOCKBAR_OUTPUTS, a comma separated list
+ * of "name:width" pairs. The outputs are placed next to each other.
+ */
+int create_bars()
+{
+	const char *env = getenv("BLOCKBAR_OUTPUTS");
+
+	if (!env || !*env) {
+		env = "headless:1920";
+	}
+
+	char *outputs = strdup(env);
+	int x = 0;
+
+	for (char *tok = strtok(outputs, ","); tok; tok = strtok(0, ",")) {
+		char *colon = strrchr(tok, ':');
+		int width = colon ? atoi(colon + 1) : 0;
+
+		if (width <= 0 || colon == tok) {
+			fprintf(stderr, "Invalid output \"%s\", expecting name:width\n",
+					tok);
+			free(outputs);
+			return 1;
+		}
+
+		*colon = 0;
+
+		bar_count++;
+		bars = realloc(bars, sizeof(struct bar) * bar_count);
+
+		struct bar *bar = &bars[bar_count - 1];
+		memset(bar, 0, sizeof(struct bar));
+
+		bar->output = strdup(tok);
+		bar->output_x = x;
+		bar->output_width = width;
+
+		x += width;
+	}
+
+	free(outputs);
+
+	dump_dir = getenv("BLOCKBAR_DUMP");
+
+	const char *format = getenv("BLOCKBAR_DUMP_FORMAT");
+
+	if (format && strcmp(format, "raw") == 0) {
+		dump_raw = 1;
+	} else if (format && strcmp(format, "png")) {
+		fprintf(stderr, "Invalid dump format \"%s\", expecting "
+				"\"png\" or \"raw\"\n", format);
+		return 1;
+	}
+
+	return 0;
+}
+
+void update_geom()
+{
+	invalidate_chrome();
+
+	for (int i = 0; i < bar_count; i++) {
+		struct bar *bar = &bars[i];
+
+		bar->x = bar->output_x + settings.marginhoriz.val.INT
+			+ settings.xoffset.val.INT;
+		bar->width = bar->output_width - settings.marginhoriz.val.INT * 2;
+
+		if (bar->ctx) {
+			cairo_destroy(bar->ctx);
+		}
+		if (bar->sfc) {
+			cairo_surface_destroy(bar->sfc);
+		}
+
+		bar->sfc = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+				bar->width, settings.height.val.INT);
+
+		if (cairo_surface_status(bar->sfc) != CAIRO_STATUS_SUCCESS) {
+			fprintf(stderr, "Failed to create cairo surface\n");
+			exit(1);
+		}
+
+		bar->ctx = cairo_create(bar->sfc);
+
+		damage_bar(i, 0, bar->width);
+	}
+
+	for (int i = 0; i < block_count; i++) {
+		struct block *blk = &blocks[i];
+
+		if (blk->id) {
+			resize_block(blk);
+		}
+	}
+
+	for (int i = 0; i < module_count; i++) {
+		struct module *mod = &modules[i];
+
+		if (mod->dl && mod->data.type == RENDER) {
+			resize_module(mod);
+		}
+	}
+}
+
+static void dump_frame(struct bar *bar)
+{
+	char path [4096];
+
+	snprintf(path, sizeof(path), "%s/%s-%06d.%s", dump_dir, bar->output,
+			bar->frame, dump_raw ? "raw" : "png");
+
+	if (!dump_raw) {
+		if (cairo_surface_write_to_png(bar->sfc, path) !=
+				CAIRO_STATUS_SUCCESS) {
+			fprintf(stderr, "Failed to write %s\n", path);
+		}
+		return;
+	}
+
+	FILE *file = fopen(path, "w");
+
+	if (!file) {
+		perror(path);
+		return;
+	}
+
+	/* native endian, premultiplied ARGB, as cairo stores it */
+	unsigned char *data = cairo_image_surface_get_data(bar->sfc);
+	int stride = cairo_image_surface_get_stride(bar->sfc);
+
+	for (int y = 0; y < settings.height.val.INT; y++) {
+		fwrite(data + y * stride, 4, bar->width, file);
+	}
+
+	fclose(file);
+}
+
+void headless_redraw(struct bar *bar)
+{
+	cairo_surface_flush(bar->sfc);
+
+	if (dump_dir) {
+		dump_frame(bar);
+	}
+
+	bar->frame++;
+}
+
+int poll_events()
+{
+	return 0;
+}
+
+void cleanup_bars()
+{
+	invalidate_chrome();
+
+	for (int i = 0; i < bar_count; i++) {
+		struct bar *bar = &bars[i];
+
+		free(bar->output);
+		cairo_destroy(bar->ctx);
+		cairo_surface_destroy(bar->sfc);
+	}
+
+	free(bars);
+}
+
+int blockbar_get_bar_width(int bar)
+{
+	return bars[bar].width;
+}
@@ -20,6 +20,7 @@
 #include "modules.h"
 #include "config.h"
 #include "render.h"
+#include "socket.h"
 #include "task.h"
 #include "window.h"
 #include "version.h"
@@ -196,21 +197,26 @@ struct module *load_module(char *path, int zindex, FILE *out, FILE *errout)
 		}
 		m->sfc = malloc(sizeof(cairo_surface_t *) * bar_count);
 		memset(m->sfc, 0, sizeof(cairo_surface_t *) * bar_count);
+		m->x = malloc(sizeof(int) * bar_count);
+		memset(m->x, 0, sizeof(int) * bar_count);
+		m->width = malloc(sizeof(int) * bar_count);
+		memset(m->width, 0, sizeof(int) * bar_count);
 
 		resize_module(m);
 
-		if (m->data.interval != 0) {
-			m->task = schedule_task(
-					module_task_exec, m->data.interval, 1);
-		}
+		update_module_task(m);
 	}
 
+	notify_module(m, 1);
+
 	fprintf(out, "Loaded \"%s\" module (%s)\n", m->data.name, path);
 	return m;
 }
 
 void unload_module(struct module *mod)
 {
+	notify_module(mod, 0);
+
 	void (*unload_func)() = module_get_function(mod, "unload");
 	if (unload_func) {
 		unload_func();
@@ -226,12 +232,14 @@ void unload_module(struct module *mod)
 	free(mod->path);
 
 	if (mod->data.type == RENDER) {
-		if (mod->sfc[0]) {
-			for (int bar = 0; bar < bar_count; bar++) {
+		for (int bar = 0; bar < bar_count; bar++) {
+			if (mod->sfc[bar]) {
 				cairo_surface_destroy(mod->sfc[bar]);
 			}
 		}
 		free(mod->sfc);
+		free(mod->x);
+		free(mod->width);
 	}
 
 	for (int i = 0; i < module_count; i++) {
@@ -245,20 +253,34 @@ void unload_module(struct module *mod)
 	}
 }
 
-void resize_module(struct module *mod)
+void update_module_task(struct module *mod)
 {
-	if (mod->sfc[0]) {
-		for (int bar = 0; bar < bar_count; bar++) {
-			cairo_surface_destroy(mod->sfc[bar]);
-		}
+	if (mod->task) {
+		cancel_task(mod->task);
+		mod->task = 0;
 	}
 
+	if (mod->data.interval == 0) {
+		return;
+	}
+
+	int mode = parse_task_mode(settings.schedule.val.STR);
+
+	mod->task = schedule_task(module_task_exec, mod->data.interval, 1,
+			mode == -1 ? TASK_RELATIVE : mode);
+}
+
+void resize_module(struct module *mod)
+{
+	/* surfaces are sized to what the module draws by redraw_module */
 	for (int bar = 0; bar < bar_count; bar++) {
-		if (bars[bar].sfc) {
-			mod->sfc[bar] = cairo_surface_create_similar_image(
-					bars[bar].sfc, CAIRO_FORMAT_ARGB32,
-					bars[bar].width, settings.height.val.INT);
+		if (mod->sfc[bar]) {
+			cairo_surface_destroy(mod->sfc[bar]);
+			mod->sfc[bar] = 0;
 		}
+
+		mod->x[bar] = 0;
+		mod->width[bar] = 0;
 	}
 }
 
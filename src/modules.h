@@ -31,6 +31,7 @@ struct module *load_module(char *path, int zindex, FILE *out, FILE *errout);
 void unload_module(struct module *mod);
 
 void resize_module(struct module *mod);
+void update_module_task(struct module *mod);
 
 void modules_init();
 void cleanup_modules();
@@ -0,0 +1,171 @@
+/* Copyright (C) 2018 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "pool.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A fixed set of worker threads that pool_run hands a batch of jobs to.
+ * The calling thread takes jobs as well, and only returns once every job
+ * of the batch has finished, so nothing else runs while a batch does.
+ */
+
+static pthread_t *threads;
+static int thread_count;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned long batch;
+static int stopping;
+static int active;
+
+static pool_job job_func;
+static void *job_data;
+static int job_count;
+static int job_next;
+
+/* Runs jobs until there are none left, must be called with lock held */
+static void take_jobs()
+{
+	while (job_next < job_count) {
+		int index = job_next++;
+
+		pthread_mutex_unlock(&lock);
+		job_func(index, job_data);
+		pthread_mutex_lock(&lock);
+	}
+}
+
+static void *worker(void *arg)
+{
+	(void) arg;
+
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&lock);
+
+	while (1) {
+		while (!stopping && batch == seen) {
+			pthread_cond_wait(&work_cond, &lock);
+		}
+
+		if (stopping) {
+			break;
+		}
+
+		seen = batch;
+
+		active++;
+		take_jobs();
+		active--;
+
+		if (active == 0) {
+			pthread_cond_signal(&done_cond);
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+static void stop_threads()
+{
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], 0);
+	}
+
+	free(threads);
+	threads = 0;
+	thread_count = 0;
+	stopping = 0;
+}
+
+void pool_init(int count)
+{
+	if (count == thread_count) {
+		return;
+	}
+
+	stop_threads();
+
+	if (count <= 0) {
+		return;
+	}
+
+	threads = malloc(sizeof(pthread_t) * count);
+
+	/* signals, like SIGCHLD for the signalfd, are only for the main thread */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	for (int i = 0; i < count; i++) {
+		int err = pthread_create(&threads[thread_count], 0, worker, 0);
+
+		if (err) {
+			fprintf(stderr, "Error creating render thread: %s\n",
+					strerror(err));
+			break;
+		}
+
+		thread_count++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, 0);
+}
+
+void pool_run(int count, pool_job job, void *data)
+{
+	if (thread_count == 0 || count <= 1) {
+		for (int i = 0; i < count; i++) {
+			job(i, data);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	job_func = job;
+	job_data = data;
+	job_count = count;
+	job_next = 0;
+
+	batch++;
+	pthread_cond_broadcast(&work_cond);
+
+	take_jobs();
+
+	while (active > 0) {
+		pthread_cond_wait(&done_cond, &lock);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
@@ -20,7 +20,9 @@
 #include "render.h"
 #include "config.h"
 #include "modules.h"
-#ifndef WAYLAND
+#include "pool.h"
+#include "socket.h"
+#if !defined(WAYLAND) && !defined(HEADLESS)
 #include "tray.h"
 #endif
 #include "types.h"
@@ -29,6 +31,12 @@
 #include <string.h>
 #include <ujson.h>
 
+#define MIN_SURFACE_WIDTH 64
+
+/* a divider, drawn once and copied to where each divider goes */
+static cairo_surface_t *div_sfc;
+static int div_valid;
+
 static void draw_rect(cairo_t *ctx, int x, int y, int w, int h, int r)
 {
 	if (r) {
@@ -47,9 +55,114 @@ static void draw_rect(cairo_t *ctx, int x, int y, int w, int h, int r)
 	cairo_fill(ctx);
 }
 
-static void draw_div(int bar, int x)
+void damage_bar(int bar, int x, int width)
 {
-	cairo_t *ctx = bars[bar].ctx;
+	struct bar *b = &bars[bar];
+	int end = x + width;
+
+	if (x < 0) {
+		x = 0;
+	}
+
+	if (end > b->width) {
+		end = b->width;
+	}
+
+	if (end <= x) {
+		return;
+	}
+
+	int n = 0;
+
+	for (int i = 0; i < b->damage_count; i++) {
+		struct damage *d = &b->damage[i];
+
+		if (d->x <= end && d->x + d->width >= x) {
+			if (d->x < x) {
+				x = d->x;
+			}
+
+			if (d->x + d->width > end) {
+				end = d->x + d->width;
+			}
+		} else {
+			b->damage[n++] = *d;
+		}
+	}
+
+	/* too fragmented to be worth tracking separately */
+	if (n == MAX_DAMAGE) {
+		for (int i = 0; i < n; i++) {
+			struct damage *d = &b->damage[i];
+
+			if (d->x < x) {
+				x = d->x;
+			}
+
+			if (d->x + d->width > end) {
+				end = d->x + d->width;
+			}
+		}
+
+		n = 0;
+	}
+
+	b->damage[n].x = x;
+	b->damage[n].width = end - x;
+	b->damage_count = n + 1;
+}
+
+/* The area of a block also covers the dividers on either side of it */
+static void damage_block_area(int bar, int x, int width)
+{
+	int div = settings.divwidth.val.INT + 1;
+
+	damage_bar(bar, x - div, width + div * 2);
+}
+
+void damage_block(struct block *blk)
+{
+	for (int bar = 0; bar < bar_count; bar++) {
+		int rendered;
+
+		if (blk->eachmon) {
+			rendered = blk->data[bar].rendered;
+		} else {
+			rendered = blk->data->rendered;
+		}
+
+		if (rendered) {
+			damage_block_area(bar, blk->x[bar], blk->width[bar]);
+		}
+	}
+}
+
+void damage_all()
+{
+	for (int bar = 0; bar < bar_count; bar++) {
+		damage_bar(bar, 0, bars[bar].width);
+	}
+}
+
+static void clip_damage(cairo_t *ctx, int bar)
+{
+	for (int i = 0; i < bars[bar].damage_count; i++) {
+		struct damage *d = &bars[bar].damage[i];
+
+		cairo_rectangle(ctx, d->x, 0, d->width, settings.height.val.INT);
+	}
+
+	cairo_clip(ctx);
+}
+
+static cairo_surface_t *get_div_sprite()
+{
+	if (div_valid) {
+		return div_sfc;
+	}
+
+	div_valid = 1;
+
 	int width = settings.divwidth.val.INT;
 	int height;
 	int y;
@@ -66,16 +179,41 @@ static void draw_div(int bar, int x)
 	if (height <= 0 ||
 		settings.divwidth.val.INT <= 0 ||
 		settings.divcolor.val.COL[3] == 0) {
-		return;
+		return 0;
 	}
 
+	div_sfc = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+			width, settings.height.val.INT);
+
+	cairo_t *ctx = cairo_create(div_sfc);
+
 	cairo_set_source_rgba(ctx,
 			settings.divcolor.val.COL[0] / 255.f,
 			settings.divcolor.val.COL[1] / 255.f,
 			settings.divcolor.val.COL[2] / 255.f,
 			settings.divcolor.val.COL[3] / 255.f);
 
-	draw_rect(ctx, x - width / 2 - 1, y, width, height, 0);
+	draw_rect(ctx, 0, y, width, height, 0);
+	cairo_destroy(ctx);
+
+	return div_sfc;
+}
+
+static void draw_div(int bar, int x)
+{
+	cairo_t *ctx = bars[bar].ctx;
+	cairo_surface_t *sprite = get_div_sprite();
+
+	if (!sprite) {
+		return;
+	}
+
+	int width = settings.divwidth.val.INT;
+	x -= width / 2 + 1;
+
+	cairo_set_source_surface(ctx, sprite, x, 0);
+	cairo_rectangle(ctx, x, 0, width, settings.height.val.INT);
+	cairo_fill(ctx);
 }
 
 static void draw_modules(int bar, int above)
@@ -125,267 +263,556 @@ static void draw_modules(int bar, int above)
 			break;
 		}
 
-		if (!mod->sfc) {
+		if (!mod->sfc || !mod->sfc[bar] || !mod->width[bar]) {
 			continue;
 		}
 
-		cairo_set_source_surface(ctx, mod->sfc[bar], 0, 0);
-		cairo_paint(ctx);
+		cairo_set_source_surface(ctx, mod->sfc[bar], mod->x[bar], 0);
+		cairo_rectangle(ctx, mod->x[bar], 0,
+				mod->width[bar], settings.height.val.INT);
+		cairo_fill(ctx);
 	}
 }
 
-static void draw_blocks(int bar)
-{
-	cairo_t *ctx = bars[bar].ctx;
+/*
+ * The rendered blocks on each side of a bar, in the order that they are
+ * placed in, and the offset of each of them from the edge of its side.
+ * Only the offsets after a block whose width changed are recalculated, and
+ * the lists are only rebuilt when blocks are shown, hidden or moved.
+ */
+struct layout {
+	int valid;
+	int width;
+	int start [SIDES];
 
-	for (int i = 0; i < block_count; i++) {
-		struct block *blk = &blocks[i];
+	int count [SIDES];
+	int *order [SIDES];
+	int *offset [SIDES];
+	/* the first position on each side whose offset is out of date */
+	int changed [SIDES];
 
-		if (!blk->id) {
-			continue;
-		}
+	int total [SIDES];
+	enum pos overlap;
+	int center_x;
 
-		int rendered;
+	/* the position of each block in its side's list, or -1 */
+	int *slot;
+	int slot_count;
 
-		if (blk->eachmon) {
-			rendered = blk->data[bar].rendered;
-		} else {
-			rendered = blk->data->rendered;
-		}
+	/* set when a block was moved, resized, shown or hidden */
+	int moved;
+};
 
-		if (!rendered) {
-			continue;
-		}
+static int layout_count;
+static struct layout *layouts;
 
-		int leftpad = 0;
-		leftpad += settings.padding.val.INT;
-		leftpad += blk->properties.padding.val.INT;
-		leftpad += blk->properties.paddingleft.val.INT;
+static struct layout *get_layout(int bar)
+{
+	if (bar >= layout_count) {
+		layouts = realloc(layouts, sizeof(struct layout) * bar_count);
+		memset(&layouts[layout_count], 0,
+				sizeof(struct layout) * (bar_count - layout_count));
+		layout_count = bar_count;
+	}
 
-		cairo_set_source_surface(ctx, blk->sfc[bar],
-				blk->x[bar] + leftpad, 0);
-		cairo_paint(ctx);
+	return &layouts[bar];
+}
+
+void invalidate_layout(int bar)
+{
+	for (int i = 0; i < layout_count; i++) {
+		if (bar == -1 || bar == i) {
+			layouts[i].valid = 0;
+		}
 	}
 }
 
-static void draw_divs(int bar)
+static int block_rendered(struct block *blk, int bar)
 {
-	struct block *last [SIDES] = {0};
-	int x [SIDES] = {0};
+	if (blk->eachmon) {
+		return blk->data[bar].rendered;
+	}
 
-#ifndef WAYLAND
-	int traywidth = get_tray_width();
+	return blk->data->rendered;
+}
 
-	if (bar == tray_bar) {
-		x[settings.trayside.val.POS] += traywidth;
+static void build_layout(struct layout *l, int bar)
+{
+	if (l->slot_count < block_count) {
+		l->slot = realloc(l->slot, sizeof(int) * block_count);
+
+		for (int pos = 0; pos < SIDES; pos++) {
+			l->order[pos] = realloc(l->order[pos], sizeof(int) * block_count);
+			l->offset[pos] = realloc(l->offset[pos],
+					sizeof(int) * block_count);
+		}
+
+		l->slot_count = block_count;
+	}
+
+	for (int pos = 0; pos < SIDES; pos++) {
+		l->count[pos] = 0;
+		l->changed[pos] = 0;
 	}
-#endif
 
 	for (int i = 0; i < block_count; i++) {
 		struct block *blk = &blocks[i];
 		enum pos pos = blk->properties.pos.val.POS;
 
-		if (!blk->id) {
-			continue;
-		}
+		l->slot[i] = -1;
 
-		int rendered;
-		if (blk->eachmon) {
-			rendered = blk->data[bar].rendered;
-		} else {
-			rendered = blk->data->rendered;
-		}
-
-		if (!rendered) {
+		if (!blk->id || !block_rendered(blk, bar)) {
 			continue;
 		}
 
-		if (pos != RIGHT || last[RIGHT] == 0) {
-			last[pos] = blk;
-		}
-
-		x[pos] += blk->width[bar];
+		l->slot[i] = l->count[pos];
+		l->order[pos][l->count[pos]++] = i;
 	}
 
-	if (x[CENTER]) {
-		int max_width = bars[bar].width / 2 - x[CENTER] / 2;
+	l->valid = 1;
+}
 
-		if (x[LEFT] > max_width) {
-			last[LEFT] = last[CENTER];
-		} else if (x[RIGHT] > max_width) {
-			last[CENTER] = last[RIGHT];
-		}
+/* Marks what has to be laid out again after a block was rendered */
+static void update_layout(struct block *blk, int bar,
+		int was_rendered, int old_width)
+{
+	struct layout *l = get_layout(bar);
+	int rendered = block_rendered(blk, bar);
+	int i = blk - blocks;
+
+	if (rendered != was_rendered) {
+		l->valid = 0;
+		blk->dirty[bar] = 1;
+		return;
 	}
 
-	for (int i = 0; i < block_count; i++) {
-		struct block *blk = &blocks[i];
-		enum pos pos = blk->properties.pos.val.POS;
+	if (!rendered || blk->width[bar] == old_width) {
+		return;
+	}
 
-		if (!blk->id) {
-			continue;
-		}
+	blk->dirty[bar] = 1;
 
-		int rendered;
-		if (blk->eachmon) {
-			rendered = blk->data[bar].rendered;
-		} else {
-			rendered = blk->data->rendered;
-		}
+	if (!l->valid || i >= l->slot_count || l->slot[i] == -1) {
+		l->valid = 0;
+		return;
+	}
 
-		if (!rendered) {
-			continue;
-		}
+	enum pos pos = blk->properties.pos.val.POS;
 
-		if (!blk->properties.nodiv.val.INT && last[pos] != blk) {
-			draw_div(bar, blk->x[bar] + blk->width[bar]);
-		}
+	/* the blocks before it on its side stay where they are */
+	if (l->slot[i] < l->changed[pos]) {
+		l->changed[pos] = l->slot[i];
 	}
+}
 
-#ifndef WAYLAND
-	if (last[settings.trayside.val.POS] && settings.traydiv.val.INT &&
-			bar == tray_bar && traywidth) {
-		int divx;
+static int place_block(struct block *blk, int bar, int x)
+{
+	int changed = blk->x[bar] != x || blk->dirty[bar];
 
-		if (settings.trayside.val.POS == RIGHT) {
-			divx = bars[bar].width - traywidth;
-		} else {
-			divx = traywidth;
-		}
+	/* redraw_block has already damaged where a dirty block was */
+	if (blk->x[bar] != x && !blk->dirty[bar]) {
+		damage_block_area(bar, blk->x[bar], blk->width[bar]);
+	}
 
-		draw_div(bar, divx);
+	if (changed) {
+		damage_block_area(bar, x, blk->width[bar]);
 	}
-#endif
+
+	blk->x[bar] = x;
+	blk->dirty[bar] = 0;
+
+	return changed;
 }
 
 static void calculate_block_x(int bar)
 {
-	int x [SIDES] = {0};
+	struct layout *l = get_layout(bar);
+	int start [SIDES] = {0};
+	int width = bars[bar].width;
 
-#ifndef WAYLAND
+#if !defined(WAYLAND) && !defined(HEADLESS)
 	if (bar == tray_bar) {
-		x[settings.trayside.val.POS] = get_tray_width();
+		start[settings.trayside.val.POS] = get_tray_width();
 	}
 #endif
 
-	for (int i = 0; i < block_count; i++) {
-		struct block *blk = &blocks[i];
-		enum pos pos = blk->properties.pos.val.POS;
-
-		if (!blk->id) {
-			continue;
-		}
+	if (!l->valid || l->width != width ||
+			memcmp(l->start, start, sizeof(start))) {
+		build_layout(l, bar);
+		l->width = width;
+		memcpy(l->start, start, sizeof(start));
+		l->moved = 1;
+	}
 
-		int rendered;
+	for (int pos = 0; pos < SIDES; pos++) {
+		int *order = l->order[pos];
+		int k = l->changed[pos];
+		int x = start[pos];
 
-		if (blk->eachmon) {
-			rendered = blk->data[bar].rendered;
-		} else {
-			rendered = blk->data->rendered;
+		if (k > 0 && k <= l->count[pos]) {
+			x = l->offset[pos][k - 1] + blocks[order[k - 1]].width[bar];
 		}
 
-		if (!rendered) {
-			continue;
+		for (; k < l->count[pos]; k++) {
+			l->offset[pos][k] = x;
+			x += blocks[order[k]].width[bar];
 		}
 
-		blk->x[bar] = x[pos];
-		x[pos] += blk->width[bar];
+		l->total[pos] = x;
 	}
 
+	int *total = l->total;
 	enum pos overlap = CENTER;
-	int max_width = bars[bar].width / 2 - x[CENTER] / 2;
+	int max_width = width / 2 - total[CENTER] / 2;
 
-	if (x[LEFT] > max_width) {
+	if (total[LEFT] > max_width) {
 		overlap = LEFT;
-	} else if (x[RIGHT] > max_width) {
+	} else if (total[RIGHT] > max_width) {
 		overlap = RIGHT;
 	}
 
-	for (int i = 0; i < block_count; i++) {
-		struct block *blk = &blocks[i];
-		enum pos pos = blk->properties.pos.val.POS;
+	for (int k = l->changed[LEFT]; k < l->count[LEFT]; k++) {
+		struct block *blk = &blocks[l->order[LEFT][k]];
+		l->moved |= place_block(blk, bar, l->offset[LEFT][k]);
+	}
 
-		if (!blk->id) {
-			continue;
-		}
+	for (int k = l->changed[RIGHT]; k < l->count[RIGHT]; k++) {
+		struct block *blk = &blocks[l->order[RIGHT][k]];
+		l->moved |= place_block(blk, bar,
+				width - l->offset[RIGHT][k] - blk->width[bar]);
+	}
 
-		int rendered;
+	int center_x = width / 2 - total[CENTER] / 2;
 
-		if (blk->eachmon) {
-			rendered = blk->data[bar].rendered;
-		} else {
-			rendered = blk->data->rendered;
+	if (overlap == LEFT) {
+		center_x = total[LEFT];
+	} else if (overlap == RIGHT) {
+		center_x = width - total[RIGHT] - total[CENTER];
+	}
+
+	/* the center moves when its width or the sides next to it change */
+	int k = center_x == l->center_x ? l->changed[CENTER] : 0;
+
+	for (; k < l->count[CENTER]; k++) {
+		struct block *blk = &blocks[l->order[CENTER][k]];
+		l->moved |= place_block(blk, bar, center_x + l->offset[CENTER][k]);
+	}
+
+	for (int pos = 0; pos < SIDES; pos++) {
+		l->changed[pos] = l->count[pos];
+	}
+
+	l->overlap = overlap;
+	l->center_x = center_x;
+}
+
+struct block *block_at(int bar, int x)
+{
+	calculate_block_x(bar);
+
+	struct layout *l = get_layout(bar);
+
+	for (int pos = 0; pos < SIDES; pos++) {
+		/* blocks on the right side are placed from right to left */
+		int rtl = pos == RIGHT;
+		int lo = 0;
+		int hi = l->count[pos] - 1;
+
+		while (lo <= hi) {
+			int mid = (lo + hi) / 2;
+			struct block *blk = &blocks[l->order[pos][mid]];
+
+			if (x <= blk->x[bar]) {
+				if (rtl) {
+					lo = mid + 1;
+				} else {
+					hi = mid - 1;
+				}
+			} else if (x >= blk->x[bar] + blk->width[bar]) {
+				if (rtl) {
+					hi = mid - 1;
+				} else {
+					lo = mid + 1;
+				}
+			} else {
+				return blk;
+			}
 		}
+	}
 
-		if (!rendered) {
-			continue;
+	return 0;
+}
+
+void cleanup_render()
+{
+	for (int i = 0; i < layout_count; i++) {
+		free(layouts[i].slot);
+
+		for (int pos = 0; pos < SIDES; pos++) {
+			free(layouts[i].order[pos]);
+			free(layouts[i].offset[pos]);
 		}
+	}
+
+	free(layouts);
+	layouts = 0;
+	layout_count = 0;
+}
+
+static void draw_blocks(int bar)
+{
+	cairo_t *ctx = bars[bar].ctx;
+	struct layout *l = get_layout(bar);
+
+	for (int pos = 0; pos < SIDES; pos++) {
+		for (int k = 0; k < l->count[pos]; k++) {
+			struct block *blk = &blocks[l->order[pos][k]];
+
+			int leftpad = 0;
+			leftpad += settings.padding.val.INT;
+			leftpad += blk->properties.padding.val.INT;
+			leftpad += blk->properties.paddingleft.val.INT;
 
-		if (pos == CENTER && overlap == CENTER) {
-			blk->x[bar] = blk->x[bar] + bars[bar].width / 2 - x[CENTER] / 2;
-		} else if (pos == RIGHT) {
-			blk->x[bar] = bars[bar].width - blk->x[bar] - blk->width[bar];
+			cairo_surface_t *sfc = blk->sfc[blk->shared ? 0 : bar];
+
+			if (!sfc) {
+				continue;
+			}
+
+			/* the surface may be wider than the block, so only fill the block */
+			cairo_set_source_surface(ctx, sfc,
+					blk->x[bar] + leftpad, 0);
+			cairo_rectangle(ctx, blk->x[bar], 0,
+					blk->width[bar], settings.height.val.INT);
+			cairo_fill(ctx);
 		}
 	}
+}
 
-	for (int i = 0; i < block_count * (overlap != CENTER); i++) {
-		struct block *blk = &blocks[i];
-		enum pos pos = blk->properties.pos.val.POS;
+static void draw_divs(int bar)
+{
+	struct layout *l = get_layout(bar);
+
+	/* the outermost block on each side has no divider after it */
+	int last [SIDES];
+	last[LEFT] = l->count[LEFT] - 1;
+	last[RIGHT] = 0;
+	last[CENTER] = l->count[CENTER] - 1;
+
+	/* unless it is next to the center, or the center is next to the right */
+	if (l->total[CENTER] && l->overlap == LEFT) {
+		last[LEFT] = -1;
+	} else if (l->total[CENTER] && l->overlap == RIGHT) {
+		last[CENTER] = -1;
+	}
 
-		if (!blk->id) {
-			continue;
+	for (int pos = 0; pos < SIDES; pos++) {
+		for (int k = 0; k < l->count[pos]; k++) {
+			struct block *blk = &blocks[l->order[pos][k]];
+
+			if (!blk->properties.nodiv.val.INT && k != last[pos]) {
+				draw_div(bar, blk->x[bar] + blk->width[bar]);
+			}
 		}
+	}
 
-		int rendered;
+#if !defined(WAYLAND) && !defined(HEADLESS)
+	int traywidth = get_tray_width();
+	enum pos trayside = settings.trayside.val.POS;
+	int last_exists = l->count[trayside] ||
+		(trayside == LEFT && l->total[CENTER] && l->overlap == LEFT);
 
-		if (blk->eachmon) {
-			rendered = blk->data[bar].rendered;
+	if (last_exists && settings.traydiv.val.INT &&
+			bar == tray_bar && traywidth) {
+		int divx;
+
+		if (trayside == RIGHT) {
+			divx = bars[bar].width - traywidth;
 		} else {
-			rendered = blk->data->rendered;
+			divx = traywidth;
 		}
 
-		if (!rendered) {
-			continue;
+		draw_div(bar, divx);
+	}
+#endif
+}
+
+/*
+ * Module and block surfaces only cover what was drawn on them. Their width
+ * grows geometrically so that content which changes by a few pixels doesn't
+ * reallocate, and they are only shrunk once they are 4 times too wide.
+ */
+static int fit_capacity(int width, int capacity)
+{
+	if (width > capacity || capacity == 0) {
+		capacity *= 2;
+
+		if (capacity < width) {
+			capacity = width;
 		}
 
-		if (pos != CENTER) {
-			continue;
+		if (capacity < MIN_SURFACE_WIDTH) {
+			capacity = MIN_SURFACE_WIDTH;
 		}
+	} else if (capacity > MIN_SURFACE_WIDTH && width < capacity / 4) {
+		capacity = width * 2;
 
-		if (overlap == LEFT) {
-			blk->x[bar] = x[LEFT] + blk->x[bar];
-		} else if (overlap == RIGHT) {
-			blk->x[bar] = bars[bar].width - x[RIGHT] - x[CENTER] + blk->x[bar];
+		if (capacity < MIN_SURFACE_WIDTH) {
+			capacity = MIN_SURFACE_WIDTH;
 		}
 	}
+
+	return capacity;
 }
 
-void redraw_module(struct module *mod, int bar)
+static cairo_surface_t *create_surface(int width)
+{
+	return cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+			width, settings.height.val.INT);
+}
+
+static void clear_surface(cairo_t *ctx)
 {
-	cairo_t *ctx = cairo_create(mod->sfc[bar]);
 	cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
 	cairo_paint(ctx);
 	cairo_set_operator(ctx, CAIRO_OPERATOR_OVER);
+}
 
+/* Compares the first width columns of two surfaces of the bar's height */
+static int same_pixels(cairo_surface_t *a, cairo_surface_t *b, int width)
+{
+	cairo_surface_flush(a);
+	cairo_surface_flush(b);
+
+	unsigned char *pa = cairo_image_surface_get_data(a);
+	unsigned char *pb = cairo_image_surface_get_data(b);
+	int stride_a = cairo_image_surface_get_stride(a);
+	int stride_b = cairo_image_surface_get_stride(b);
+
+	for (int y = 0; y < settings.height.val.INT; y++) {
+		if (memcmp(pa + y * stride_a, pb + y * stride_b, width * 4) != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void redraw_module(struct module *mod, int bar)
+{
 	int (*func)(cairo_t *, int) = module_get_function(mod, "render");
 
+	/*
+	 * Render modules may draw anywhere on the bar, so they are recorded
+	 * first and only the area that was drawn on is kept.
+	 */
+	cairo_rectangle_t extents = {
+		0, 0, bars[bar].width, settings.height.val.INT
+	};
+	cairo_surface_t *rec = cairo_recording_surface_create(
+			CAIRO_CONTENT_COLOR_ALPHA, &extents);
+	cairo_t *ctx = cairo_create(rec);
+
 	func(ctx, bar);
 	cairo_destroy(ctx);
+
+	double ink_x, ink_y, ink_width, ink_height;
+	cairo_recording_surface_ink_extents(rec,
+			&ink_x, &ink_y, &ink_width, &ink_height);
+
+	int left = ink_x < 0 ? 0 : (int) ink_x;
+	int right = (int) (ink_x + ink_width);
+
+	if (right < ink_x + ink_width) {
+		right++;
+	}
+
+	if (right > bars[bar].width) {
+		right = bars[bar].width;
+	}
+
+	int old_x = mod->x[bar];
+	int old_width = mod->width[bar];
+	int width = right > left ? right - left : 0;
+
+	mod->x[bar] = left;
+	mod->width[bar] = width;
+
+	if (width == 0) {
+		cairo_surface_destroy(rec);
+		damage_bar(bar, old_x, old_width);
+		return;
+	}
+
+	int capacity = 0;
+
+	if (mod->sfc[bar]) {
+		capacity = cairo_image_surface_get_width(mod->sfc[bar]);
+	}
+
+	cairo_surface_t *sfc = create_surface(fit_capacity(width, capacity));
+
+	ctx = cairo_create(sfc);
+	cairo_set_source_surface(ctx, rec, -left, 0);
+	cairo_paint(ctx);
+	cairo_destroy(ctx);
+
+	cairo_surface_destroy(rec);
+
+	/* modules that are drawn on every redraw usually draw the same thing, so
+	 * the bar is only damaged where what they drew has changed
+	 */
+	if (capacity && left == old_x && width == old_width &&
+			same_pixels(sfc, mod->sfc[bar], width)) {
+		cairo_surface_destroy(sfc);
+		return;
+	}
+
+	if (mod->sfc[bar]) {
+		cairo_surface_destroy(mod->sfc[bar]);
+	}
+
+	mod->sfc[bar] = sfc;
+
+	damage_bar(bar, old_x, old_width);
+	damage_bar(bar, left, width);
 }
 
-static void draw_bar(int bar)
+void invalidate_chrome()
 {
-	cairo_t *ctx = bars[bar].ctx;
+	for (int bar = 0; bar < bar_count; bar++) {
+		if (bars[bar].chrome) {
+			cairo_surface_destroy(bars[bar].chrome);
+			bars[bar].chrome = 0;
+		}
+	}
 
-	cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
-	cairo_paint(ctx);
+	if (div_sfc) {
+		cairo_surface_destroy(div_sfc);
+		div_sfc = 0;
+	}
 
-	cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+	div_valid = 0;
+}
+
+/* Returns the bar's background and border, which only change with settings */
+static cairo_surface_t *get_chrome(int bar)
+{
+	if (bars[bar].chrome) {
+		return bars[bar].chrome;
+	}
 
 	int b = settings.borderwidth.val.INT;
 	int r = settings.radius.val.INT;
 	int w = bars[bar].width;
 	int h = settings.height.val.INT;
 
+	bars[bar].chrome = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
+
+	cairo_t *ctx = cairo_create(bars[bar].chrome);
+
+	cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+
 	if (b) {
 		cairo_set_source_rgba(ctx,
 				settings.bordercolor.val.COL[0]/255.f,
@@ -408,7 +835,15 @@ static void draw_bar(int bar)
 		cairo_paint(ctx);
 	}
 
-	cairo_set_operator(ctx, CAIRO_OPERATOR_OVER);
+	cairo_destroy(ctx);
+
+	return bars[bar].chrome;
+}
+
+/* Draws the bar onto its surface, which is then presented by present_bar */
+static void compose_bar(int bar)
+{
+	cairo_t *ctx = bars[bar].ctx;
 
 	calculate_block_x(bar);
 
@@ -419,11 +854,27 @@ static void draw_bar(int bar)
 			continue;
 		}
 
-		if (mod->data.interval == 0) {
+		/* redraw has already drawn the ones that aren't thread-safe,
+		 * redraw_module damages where what they drew has changed
+		 */
+		if (mod->data.interval == 0 &&
+				mod->data.flags & MFLAG_THREAD_SAFE) {
 			redraw_module(mod, bar);
 		}
 	}
 
+	if (bars[bar].damage_count == 0) {
+		return;
+	}
+
+	cairo_save(ctx);
+	clip_damage(ctx, bar);
+
+	cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(ctx, get_chrome(bar), 0, 0);
+	cairo_paint(ctx);
+	cairo_set_operator(ctx, CAIRO_OPERATOR_OVER);
+
 	draw_modules(bar, 0);
 
 	draw_blocks(bar);
@@ -431,73 +882,274 @@ static void draw_bar(int bar)
 
 	draw_modules(bar, 1);
 
+	cairo_restore(ctx);
+}
+
+static void present_bar(int bar)
+{
+	if (bars[bar].damage_count == 0) {
+		return;
+	}
+
 #ifdef WAYLAND
 	wl_redraw(&bars[bar]);
+#elif defined(HEADLESS)
+	headless_redraw(&bars[bar]);
 #else
-	ctx = bars[bar].ctx_visible;
-	cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
-	cairo_set_source_surface(ctx, bars[bar].sfc, 0, 0);
-	cairo_paint(ctx);
+	x_redraw(&bars[bar]);
 #endif
+
+	bars[bar].damage_count = 0;
+}
+
+static void compose_job(int bar, void *data)
+{
+	(void) data;
+
+	compose_bar(bar);
 }
 
 void redraw()
 {
+	if (bar_count == 0) {
+		return;
+	}
+
+	/* state that is shared by the bars is created before they are drawn */
+	get_layout(bar_count - 1);
+	get_div_sprite();
+
+#if !defined(WAYLAND) && !defined(HEADLESS)
+	x_wait_redraw();
+#endif
+
+	for (int i = 0; i < module_count; i++) {
+		struct module *mod = &modules[i];
+
+		if (!mod->dl || mod->data.type != RENDER ||
+				mod->data.interval != 0 ||
+				mod->data.flags & MFLAG_THREAD_SAFE) {
+			continue;
+		}
+
+		for (int bar = 0; bar < bar_count; bar++) {
+			redraw_module(mod, bar);
+		}
+	}
+
+	pool_run(bar_count, compose_job, 0);
+
+	/* the display connection is only used from the main thread */
 	for (int i = 0; i < bar_count; i++) {
-		draw_bar(i);
+		present_bar(i);
 	}
 
-#ifndef WAYLAND
+#if !defined(WAYLAND) && !defined(HEADLESS)
 	XFlush(disp);
 #endif
+
+	for (int i = 0; i < bar_count; i++) {
+		struct layout *l = get_layout(i);
+
+		if (l->moved) {
+			l->moved = 0;
+			notify_layout(i);
+		}
+	}
 }
 
-void redraw_block(struct block *blk)
+static int render_block(int (*func)(cairo_t *, struct block *, int),
+		struct block *blk, int bar, cairo_surface_t *sfc)
 {
-	for (int bar = 0; bar < bar_count; bar++) {
-		int *rendered;
+	cairo_t *ctx = cairo_create(sfc);
+	clear_surface(ctx);
 
-		if (blk->eachmon) {
-			rendered = &(blk->data[bar].rendered);
+	int width = func(ctx, blk, bar);
+	cairo_destroy(ctx);
+
+	return width;
+}
+
+static void render_block_bar(struct block *blk,
+		int (*func)(cairo_t *, struct block *, int), int bar)
+{
+	int *rendered;
+
+	if (blk->eachmon) {
+		rendered = &(blk->data[bar].rendered);
+	} else {
+		rendered = &(blk->data->rendered);
+	}
+
+	*rendered = 0;
+
+	if (!func) {
+		return;
+	}
+
+	int capacity;
+
+	if (blk->sfc[bar]) {
+		capacity = cairo_image_surface_get_width(blk->sfc[bar]);
+	} else {
+		/* the last width is a good guess after a resize */
+		capacity = fit_capacity(blk->width[bar], 0);
+		blk->sfc[bar] = create_surface(capacity);
+	}
+
+	int width = render_block(func, blk, bar, blk->sfc[bar]);
+	int fit = fit_capacity(width, capacity);
+
+	if (fit != capacity) {
+		cairo_surface_t *sfc = create_surface(fit);
+
+		if (fit > capacity) {
+			/* the content was cut off, so it has to be drawn again */
+			width = render_block(func, blk, bar, sfc);
 		} else {
-			rendered = &(blk->data->rendered);
+			cairo_t *ctx = cairo_create(sfc);
+			cairo_set_source_surface(ctx, blk->sfc[bar], 0, 0);
+			cairo_paint(ctx);
+			cairo_destroy(ctx);
 		}
 
-		*rendered = 0;
+		cairo_surface_destroy(blk->sfc[bar]);
+		blk->sfc[bar] = sfc;
+	}
 
-		struct module *mod = get_module_by_name(blk->properties.module.val.STR);
+	if (width == 0) {
+		return;
+	}
 
-		if (!mod) {
-			continue;
+	width += settings.padding.val.INT * 2;
+	width += blk->properties.padding.val.INT * 2;
+	width += blk->properties.paddingleft.val.INT;
+	width += blk->properties.paddingright.val.INT;
+
+	*rendered = 1;
+
+	blk->width[bar] = width;
+}
+
+/*
+ * A block is rendered for one bar, or with a bar of -1 for every bar that
+ * doesn't share its surface. Blocks without eachmon share their "rendered"
+ * flag between bars, so they are never split up between threads.
+ */
+struct render_job {
+	struct block *blk;
+	int (*func)(cairo_t *, struct block *, int);
+	int bar;
+};
+
+static void render_job(int index, void *data)
+{
+	struct render_job *job = &((struct render_job *) data)[index];
+	struct block *blk = job->blk;
+
+	if (job->bar != -1) {
+		render_block_bar(blk, job->func, job->bar);
+		return;
+	}
+
+	for (int bar = 0; bar < (blk->shared ? 1 : bar_count); bar++) {
+		render_block_bar(blk, job->func, bar);
+	}
+}
+
+void redraw_blocks(struct block **list, int count)
+{
+	if (count == 0 || bar_count == 0) {
+		return;
+	}
+
+	int was_rendered [count][bar_count];
+	int old_width [count][bar_count];
+
+	struct render_job parallel [count * bar_count];
+	struct render_job serial [count * bar_count];
+	int parallel_count = 0;
+	int serial_count = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct block *blk = list[i];
+
+		/* the area that the block covered may be left empty */
+		damage_block(blk);
+
+		struct module *mod =
+			get_module_by_name(blk->properties.module.val.STR);
+
+		/* every bar has the same height and font, so exec_data looks the same */
+		blk->shared = !blk->eachmon && mod &&
+			!(mod->data.flags & MFLAG_RENDER_EACHMON);
+
+		for (int bar = 0; bar < bar_count; bar++) {
+			was_rendered[i][bar] = block_rendered(blk, bar);
+			old_width[i][bar] = blk->width[bar];
 		}
 
-		int (*func)(cairo_t *, struct block *, int) =
-			module_get_function(mod, "render");
+		struct render_job job = {
+			.blk = blk,
+			.func = mod ? module_get_function(mod, "render") : 0,
+			.bar = -1,
+		};
 
-		if (!func) {
-			continue;
+		int safe = mod && mod->data.flags & MFLAG_THREAD_SAFE;
+
+		for (int bar = 0; bar < (blk->eachmon ? bar_count : 1); bar++) {
+			if (blk->eachmon) {
+				job.bar = bar;
+			}
+
+			if (safe) {
+				parallel[parallel_count++] = job;
+			} else {
+				serial[serial_count++] = job;
+			}
 		}
+	}
 
-		cairo_t *ctx = cairo_create(blk->sfc[bar]);
+	for (int i = 0; i < serial_count; i++) {
+		render_job(i, serial);
+	}
 
-		cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
-		cairo_paint(ctx);
-		cairo_set_operator(ctx, CAIRO_OPERATOR_OVER);
+	pool_run(parallel_count, render_job, parallel);
 
-		int width = func(ctx, blk, bar);
-		cairo_destroy(ctx);
+	for (int i = 0; i < count; i++) {
+		struct block *blk = list[i];
 
-		if (width == 0) {
-			continue;
+		for (int bar = 1; bar < bar_count && blk->shared; bar++) {
+			/* the first bar's surface is composited onto every bar */
+			if (blk->sfc[bar]) {
+				cairo_surface_destroy(blk->sfc[bar]);
+				blk->sfc[bar] = 0;
+			}
+
+			blk->width[bar] = blk->width[0];
 		}
 
-		width += settings.padding.val.INT * 2;
-		width += blk->properties.padding.val.INT * 2;
-		width += blk->properties.paddingleft.val.INT;
-		width += blk->properties.paddingright.val.INT;
+		for (int bar = 0; bar < bar_count; bar++) {
+			update_layout(blk, bar, was_rendered[i][bar], old_width[i][bar]);
+		}
+	}
+}
 
-		*rendered = 1;
+void redraw_block(struct block *blk)
+{
+	redraw_blocks(&blk, 1);
+}
+
+void redraw_all_blocks()
+{
+	struct block *list [block_count];
+	int count = 0;
 
-		blk->width[bar] = width;
+	for (int i = 0; i < block_count; i++) {
+		if (blocks[i].id) {
+			list[count++] = &blocks[i];
+		}
 	}
+
+	redraw_blocks(list, count);
 }
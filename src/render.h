@@ -24,6 +24,15 @@
 
 void redraw();
 void redraw_block(struct block *blk);
+void redraw_blocks(struct block **list, int count);
+void redraw_all_blocks();
 void redraw_module(struct module *mod, int bar);
+void damage_bar(int bar, int x, int width);
+void damage_block(struct block *blk);
+void damage_all();
+void invalidate_chrome();
+void invalidate_layout(int bar);
+struct block *block_at(int bar, int x);
+void cleanup_render();
 
 #endif /* RENDER_H */
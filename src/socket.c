@@ -17,66 +17,940 @@
  * 3. This notice may not be removed or altered from any source distribution.
  */
 
+#define _GNU_SOURCE
+
 #include "socket.h"
 #include "bbc.h"
 #include "config.h"
+#include "event.h"
 #include "exec.h"
 #include "modules.h"
+#include "pool.h"
 #include "render.h"
 #include "types.h"
-#ifndef WAYLAND
+#if !defined(WAYLAND) && !defined(HEADLESS)
 #include "tray.h"
 #endif
 #include "util.h"
-#include <poll.h>
+#include <errno.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
-int socket_init()
+int socket_init()
+{
+	signal(SIGPIPE, SIG_IGN);
+
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	if (sockfd < 0) {
+		fprintf(stderr, "Error opening socket\n");
+		return -1;
+	}
+
+	char *socketpath = getenv("BLOCKBAR_SOCKET");
+	if (!socketpath) {
+		socketpath = defsocketpath;
+	}
+
+	struct sockaddr_un sock_addr;
+
+	sock_addr.sun_family = AF_UNIX;
+	strcpy(sock_addr.sun_path, socketpath);
+
+	unlink(socketpath);
+	if (bind(sockfd, (struct sockaddr *) &sock_addr, sizeof(sock_addr)) == -1) {
+		fprintf(stderr, "Error binding socket\n");
+		return -1;
+	}
+
+	if (listen(sockfd, SOMAXCONN) == -1) {
+		fprintf(stderr, "Error listening to socket\n");
+		return -1;
+	}
+
+	return sockfd;
+}
+
+/*
+ * Between "begin" and "commit", the work that commands do to show their
+ * changes is held back, so that the whole group is laid out and drawn once
+ * when it is committed.
+ */
+static struct {
+	int open;
+	int failed;
+	int skipped;
+
+	int geom;
+	int tray;
+	int icons;
+	int all_blocks;
+	int bars;
+
+	int *blocks;
+	int block_count;
+} txn;
+
+static void update_block(struct block *blk)
+{
+	if (!txn.open) {
+		redraw_block(blk);
+		return;
+	}
+
+	for (int i = 0; i < txn.block_count; i++) {
+		if (txn.blocks[i] == blk->id) {
+			return;
+		}
+	}
+
+	txn.blocks = realloc(txn.blocks, sizeof(*txn.blocks) *
+			(txn.block_count + 1));
+	txn.blocks[txn.block_count++] = blk->id;
+}
+
+static void update_all_blocks()
+{
+	if (txn.open) {
+		txn.all_blocks = 1;
+	} else {
+		redraw_all_blocks();
+		damage_all();
+	}
+}
+
+static void update_bars()
+{
+	if (txn.open) {
+		txn.bars = 1;
+	} else {
+		redraw();
+	}
+}
+
+static void commit_txn()
+{
+	txn.open = 0;
+
+	if (txn.geom) {
+		update_geom();
+	}
+
+#if !defined(WAYLAND) && !defined(HEADLESS)
+	if (txn.tray) {
+		redraw_tray();
+	}
+
+	if (txn.icons) {
+		reparent_icons();
+	}
+#endif
+
+	if (txn.all_blocks || txn.geom) {
+		redraw_all_blocks();
+		damage_all();
+	} else if (txn.block_count > 0) {
+		struct block *list [txn.block_count];
+		int count = 0;
+
+		for (int i = 0; i < txn.block_count; i++) {
+			struct block *blk = get_block(txn.blocks[i]);
+
+			if (blk) {
+				list[count++] = blk;
+			}
+		}
+
+		redraw_blocks(list, count);
+	}
+
+	if (txn.bars || txn.all_blocks || txn.geom || txn.block_count > 0) {
+		redraw();
+	}
+
+	free(txn.blocks);
+	memset(&txn, 0, sizeof(txn));
+}
+
+/*
+ * Each connection carries one request, which is read, run and answered
+ * without blocking, so a slow client never holds up the main loop.
+ * Replies are buffered until the socket can take them, and the client is
+ * not read from again while its reply is waiting to be sent.
+ */
+struct client {
+	int fd;
+
+	/* the protocol version, or 0 until the request starts arriving */
+	int version;
+
+	char *in;
+	size_t in_len;
+	/* how much of a framed request is made of whole frames */
+	size_t in_framed;
+
+	char *out;
+	size_t out_len;
+	size_t out_sent;
+	int writing;
+
+	/* the stream that the end of the reply is written to, and for framed
+	 * replies, where the header of its frame is
+	 */
+	int stream;
+	size_t frame;
+
+	/* set by "subscribe", after which the connection is kept open */
+	struct subscription *sub;
+};
+
+/*
+ * Subscribers are sent events as lines of JSON. Events that haven't been
+ * sent yet are queued, and once MAX_QUEUED are waiting, an event that
+ * describes the current state of something replaces the one before it,
+ * while others are dropped and counted.
+ */
+#define MAX_QUEUED 256
+
+/* the most buffers that are passed to writev at once */
+#define MAX_IOV 64
+
+enum sub_type {
+	SUB_CONTENT,
+	SUB_CLICK,
+	SUB_LAYOUT,
+	SUB_OUTPUT,
+	SUB_MODULE,
+	SUB_SETTING,
+	SUB_TYPES
+};
+
+static const char *sub_names [] = {
+	"content",
+	"click",
+	"layout",
+	"output",
+	"module",
+	"setting",
+};
+
+/* a queued event is kept as it is sent, including its frame header */
+struct queued {
+	enum sub_type type;
+	long key;
+	int bar;
+
+	char *data;
+	size_t len;
+};
+
+struct subscription {
+	int types;
+
+	/* if any are given, block events are only sent for these blocks */
+	int *blocks;
+	int block_count;
+
+	struct queued queue [MAX_QUEUED];
+	int queue_count;
+	/* how much of the first queued event has been sent */
+	size_t queue_sent;
+	unsigned long dropped;
+};
+
+static void vappendf(char **buf, size_t *len, const char *fmt, va_list args)
+{
+	va_list copy;
+
+	va_copy(copy, args);
+	int n = vsnprintf(0, 0, fmt, copy);
+	va_end(copy);
+
+	if (n < 0) {
+		return;
+	}
+
+	*buf = realloc(*buf, *len + n + 1);
+	vsnprintf(*buf + *len, n + 1, fmt, args);
+
+	*len += n;
+}
+
+static void appendf(char **buf, size_t *len, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vappendf(buf, len, fmt, args);
+	va_end(args);
+}
+
+static void put_frame_header(char *head, int type, size_t len)
+{
+	head[0] = type;
+	head[1] = len & 0xff;
+	head[2] = (len >> 8) & 0xff;
+	head[3] = (len >> 16) & 0xff;
+	head[4] = (len >> 24) & 0xff;
+}
+
+static void reply_frame(struct client *cl, int type, const char *data,
+		size_t len)
+{
+	cl->out = realloc(cl->out, cl->out_len + framehead + len);
+	put_frame_header(cl->out + cl->out_len, type, len);
+	if (len)
+		memcpy(cl->out + cl->out_len + framehead, data, len);
+	cl->out_len += framehead + len;
+
+	cl->stream = 0;
+}
+
+/* makes what is appended to the reply next go to stream */
+static void begin_output(struct client *cl, int stream)
+{
+	if (cl->stream == stream) {
+		return;
+	}
+
+	cl->stream = stream;
+
+	if (cl->version == 1) {
+		appendf(&cl->out, &cl->out_len, "%c%c", setout, stream);
+	} else {
+		cl->frame = cl->out_len;
+		reply_frame(cl, stream == rstdout ? framestdout : framestderr, 0, 0);
+		cl->stream = stream;
+	}
+}
+
+static void end_output(struct client *cl)
+{
+	if (cl->version != 1) {
+		put_frame_header(cl->out + cl->frame, cl->out[cl->frame],
+				cl->out_len - cl->frame - framehead);
+	}
+}
+
+static void reply(struct client *cl, int stream, const char *fmt, ...)
+{
+	va_list args;
+
+	begin_output(cl, stream);
+
+	va_start(args, fmt);
+	vappendf(&cl->out, &cl->out_len, fmt, args);
+	va_end(args);
+
+	end_output(cl);
+}
+
+static void reply_data(struct client *cl, int stream, const char *data,
+		size_t len)
+{
+	begin_output(cl, stream);
+
+	cl->out = realloc(cl->out, cl->out_len + len);
+	memcpy(cl->out + cl->out_len, data, len);
+	cl->out_len += len;
+
+	end_output(cl);
+}
+
+static void reply_ret(struct client *cl, int ret)
+{
+	char c = ret;
+
+	if (cl->version == 1) {
+		appendf(&cl->out, &cl->out_len, "%c%c", setret, c);
+		cl->stream = 0;
+	} else {
+		reply_frame(cl, frameret, &c, 1);
+	}
+}
+
+/* copies what was written to a temporary file into the client's stdout */
+static void reply_file(struct client *cl, FILE *file)
+{
+	char buf [bbcbuffsize];
+	size_t n;
+
+	rewind(file);
+
+	while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+		reply_data(cl, rstdout, buf, n);
+	}
+
+	fclose(file);
+}
+
+static void queue_dropped(struct client *cl);
+
+/*
+ * Writes as much of the reply, and then of the queued events, as the socket
+ * takes. Returns 1 if some of it is still waiting to be sent.
+ */
+static int flush_client(struct client *cl)
+{
+	struct subscription *sub = cl->sub;
+
+	while (1) {
+		struct iovec iov [MAX_IOV];
+		int count = 0;
+
+		if (cl->out_sent < cl->out_len) {
+			iov[count].iov_base = cl->out + cl->out_sent;
+			iov[count++].iov_len = cl->out_len - cl->out_sent;
+		}
+
+		for (int i = 0; sub && i < sub->queue_count && count < MAX_IOV; i++) {
+			size_t skip = i == 0 ? sub->queue_sent : 0;
+
+			iov[count].iov_base = sub->queue[i].data + skip;
+			iov[count++].iov_len = sub->queue[i].len - skip;
+		}
+
+		if (count == 0) {
+			/* the dropped events came after the ones that were queued */
+			if (sub && sub->dropped) {
+				queue_dropped(cl);
+				continue;
+			}
+
+			return 0;
+		}
+
+		ssize_t n = writev(cl->fd, iov, count);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+		}
+
+		size_t reply_sent = cl->out_len - cl->out_sent;
+
+		if ((size_t) n < reply_sent) {
+			cl->out_sent += n;
+			continue;
+		}
+
+		n -= reply_sent;
+		cl->out_sent = cl->out_len = 0;
+		cl->stream = 0;
+
+		while (n > 0) {
+			struct queued *q = &sub->queue[0];
+			size_t left = q->len - sub->queue_sent;
+
+			if ((size_t) n < left) {
+				sub->queue_sent += n;
+				break;
+			}
+
+			n -= left;
+			free(q->data);
+			memmove(&sub->queue[0], &sub->queue[1],
+					sizeof(*q) * --sub->queue_count);
+			sub->queue_sent = 0;
+		}
+	}
+}
+
+static struct client **subscribers;
+static int subscriber_count;
+
+/* the position and width of each block that subscribers were last sent */
+static struct {
+	int id;
+	int bar;
+	int x;
+	int width;
+} *placed;
+static int placed_count;
+
+static void close_client(struct client *cl)
+{
+	event_remove(cl->fd);
+	close(cl->fd);
+
+	if (cl->sub) {
+		for (int i = 0; i < subscriber_count; i++) {
+			if (subscribers[i] == cl) {
+				memmove(&subscribers[i], &subscribers[i + 1],
+						sizeof(*subscribers) * (subscriber_count - i - 1));
+				subscriber_count--;
+				break;
+			}
+		}
+
+		if (subscriber_count == 0) {
+			free(placed);
+			placed = 0;
+			placed_count = 0;
+		}
+
+		for (int i = 0; i < cl->sub->queue_count; i++) {
+			free(cl->sub->queue[i].data);
+		}
+
+		free(cl->sub->blocks);
+		free(cl->sub);
+	}
+
+	free(cl->in);
+	free(cl->out);
+	free(cl);
+}
+
+static void send_events(struct client *cl)
+{
+	int r = flush_client(cl);
+
+	if (r == -1) {
+		close_client(cl);
+		return;
+	}
+
+	if (r != cl->writing) {
+		cl->writing = r;
+		event_modify(cl->fd, EVENT_READ | (r ? EVENT_WRITE : 0));
+	}
+}
+
+static void queue_event(struct client *cl, enum sub_type type, long key,
+		int bar, char *line, size_t len)
+{
+	struct subscription *sub = cl->sub;
+	int coalesce = type != SUB_CLICK && type != SUB_MODULE;
+	size_t head = cl->version == 1 ? 0 : framehead;
+
+	struct queued *q = 0;
+
+	/* the first event may have been partly sent already */
+	for (int i = sub->queue_sent ? 1 : 0; coalesce && i < sub->queue_count;
+			i++) {
+		if (sub->queue[i].type == type && sub->queue[i].key == key &&
+				sub->queue[i].bar == bar) {
+			q = &sub->queue[i];
+			break;
+		}
+	}
+
+	if (!q) {
+		if (sub->queue_count == MAX_QUEUED) {
+			sub->dropped++;
+			return;
+		}
+
+		q = &sub->queue[sub->queue_count++];
+		q->type = type;
+		q->key = key;
+		q->bar = bar;
+		q->data = 0;
+	}
+
+	q->data = realloc(q->data, head + len);
+	q->len = head + len;
+
+	if (head) {
+		put_frame_header(q->data, framestdout, len);
+	}
+
+	memcpy(q->data + head, line, len);
+}
+
+static void queue_dropped(struct client *cl)
+{
+	struct subscription *sub = cl->sub;
+	char *line = 0;
+	size_t len = 0;
+
+	appendf(&line, &len, "{\"event\":\"dropped\",\"count\":%lu}\n",
+			sub->dropped);
+	sub->dropped = 0;
+
+	/* it isn't about anything that a later event could replace */
+	queue_event(cl, SUB_TYPES, 0, -1, line, len);
+	free(line);
+}
+
+/* block is the id of the block that the event is about, 0 for none, or -1 if
+ * it isn't about blocks
+ */
+static int wants(struct subscription *sub, enum sub_type type, int block)
+{
+	if (!(sub->types & (1 << type))) {
+		return 0;
+	}
+
+	if (block == -1 || sub->block_count == 0) {
+		return 1;
+	}
+
+	for (int i = 0; i < sub->block_count; i++) {
+		if (sub->blocks[i] == block) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int anyone_wants(enum sub_type type, int block)
+{
+	for (int i = 0; i < subscriber_count; i++) {
+		if (wants(subscribers[i]->sub, type, block)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* sends an event to every subscriber, or adds it to the reply of cl */
+static void publish(struct client *cl, enum sub_type type, int block,
+		long key, int bar, char *line, size_t len)
+{
+	/* the state a client starts with is part of its reply */
+	if (cl) {
+		reply_data(cl, rstdout, line, len);
+		return;
+	}
+
+	/* a subscriber that has gone away is removed from the list */
+	for (int i = subscriber_count - 1; i >= 0; i--) {
+		struct client *sub = subscribers[i];
+
+		if (wants(sub->sub, type, block)) {
+			queue_event(sub, type, key, bar, line, len);
+			send_events(sub);
+		}
+	}
+}
+
+static void append_json(char **buf, size_t *len, const char *str)
+{
+	if (!str) {
+		appendf(buf, len, "null");
+		return;
+	}
+
+	/* blocks can output a lot, so the line is grown once and the bytes
+	 * between escapes are copied in runs
+	 */
+	size_t size = 2;
+
+	for (const unsigned char *c = (const unsigned char *) str; *c; c++) {
+		if (*c == '"' || *c == '\\' || *c == '\n') {
+			size += 2;
+		} else if (*c < 0x20) {
+			size += 6;
+		} else {
+			size++;
+		}
+	}
+
+	*buf = realloc(*buf, *len + size + 1);
+
+	char *p = *buf + *len;
+	*p++ = '"';
+
+	const unsigned char *run = (const unsigned char *) str;
+
+	for (const unsigned char *c = run; ; c++) {
+		if (*c >= 0x20 && *c != '"' && *c != '\\') {
+			continue;
+		}
+
+		memcpy(p, run, c - run);
+		p += c - run;
+
+		if (!*c) {
+			break;
+		}
+
+		if (*c == '"' || *c == '\\') {
+			*p++ = '\\';
+			*p++ = *c;
+		} else if (*c == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+		} else {
+			p += sprintf(p, "\\u%04x", *c);
+		}
+
+		run = c + 1;
+	}
+
+	*p++ = '"';
+	*p = 0;
+
+	*len = p - *buf;
+}
+
+static void append_output(char **buf, size_t *len, int bar)
+{
+	append_json(buf, len, bar >= 0 && bar < bar_count ? bars[bar].output : 0);
+}
+
+static void send_content(struct client *cl, struct block *blk, int bar)
+{
+	char *line = 0;
+	size_t len = 0;
+
+	if (!blk->eachmon) {
+		bar = -1;
+	}
+
+	appendf(&line, &len, "{\"event\":\"content\",\"block\":%d,\"output\":",
+			blk->id);
+	append_output(&line, &len, bar);
+	appendf(&line, &len, ",\"data\":");
+	append_json(&line, &len,
+			blk->eachmon ? blk->data[bar].exec_data : blk->data->exec_data);
+	appendf(&line, &len, "}\n");
+
+	publish(cl, SUB_CONTENT, blk->id, blk->id, bar, line, len);
+	free(line);
+}
+
+static void send_layout(struct client *cl, struct block *blk, int bar,
+		int x, int width)
+{
+	char *line = 0;
+	size_t len = 0;
+
+	appendf(&line, &len, "{\"event\":\"layout\",\"block\":%d,\"output\":",
+			blk->id);
+	append_output(&line, &len, bar);
+	appendf(&line, &len, ",\"x\":%d,\"width\":%d}\n", x, width);
+
+	publish(cl, SUB_LAYOUT, blk->id, blk->id, bar, line, len);
+	free(line);
+}
+
+static void send_outputs(struct client *cl)
+{
+	char *line = 0;
+	size_t len = 0;
+
+	appendf(&line, &len, "{\"event\":\"output\",\"outputs\":[");
+
+	for (int i = 0; i < bar_count; i++) {
+		appendf(&line, &len, "%s{\"name\":", i ? "," : "");
+		append_output(&line, &len, i);
+		appendf(&line, &len, ",\"width\":%d}", bars[i].width);
+	}
+
+	appendf(&line, &len, "]}\n");
+
+	publish(cl, SUB_OUTPUT, -1, 0, -1, line, len);
+	free(line);
+}
+
+static int block_width(struct block *blk, int bar)
+{
+	int rendered = blk->eachmon ? blk->data[bar].rendered :
+		blk->data->rendered;
+
+	return rendered ? blk->width[bar] : 0;
+}
+
+void notify_content(struct block *blk, int bar)
+{
+	if (anyone_wants(SUB_CONTENT, blk->id)) {
+		send_content(0, blk, bar);
+	}
+}
+
+void notify_click(struct block *blk, struct click *cd)
+{
+	if (!anyone_wants(SUB_CLICK, blk ? blk->id : 0)) {
+		return;
+	}
+
+	char *line = 0;
+	size_t len = 0;
+
+	if (blk) {
+		appendf(&line, &len, "{\"event\":\"click\",\"block\":%d", blk->id);
+	} else {
+		appendf(&line, &len, "{\"event\":\"click\",\"block\":null");
+	}
+
+	appendf(&line, &len, ",\"output\":");
+	append_output(&line, &len, cd->bar);
+	appendf(&line, &len, ",\"button\":%d,\"x\":%d}\n", cd->button, cd->x);
+
+	publish(0, SUB_CLICK, blk ? blk->id : 0, 0, cd->bar, line, len);
+	free(line);
+}
+
+void notify_layout(int bar)
+{
+	if (!anyone_wants(SUB_LAYOUT, -1)) {
+		return;
+	}
+
+	for (int i = 0; i < block_count; i++) {
+		struct block *blk = &blocks[i];
+
+		if (!blk->id) {
+			continue;
+		}
+
+		int x = blk->x[bar];
+		int width = block_width(blk, bar);
+		int j;
+
+		for (j = 0; j < placed_count; j++) {
+			if (placed[j].id == blk->id && placed[j].bar == bar) {
+				break;
+			}
+		}
+
+		if (j == placed_count) {
+			placed = realloc(placed, sizeof(*placed) * ++placed_count);
+			placed[j].id = blk->id;
+			placed[j].bar = bar;
+		} else if (placed[j].x == x && placed[j].width == width) {
+			continue;
+		}
+
+		placed[j].x = x;
+		placed[j].width = width;
+
+		send_layout(0, blk, bar, x, width);
+	}
+}
+
+void notify_outputs()
+{
+	if (anyone_wants(SUB_OUTPUT, -1)) {
+		send_outputs(0);
+	}
+}
+
+void notify_module(struct module *mod, int loaded)
+{
+	if (!anyone_wants(SUB_MODULE, -1)) {
+		return;
+	}
+
+	char *line = 0;
+	size_t len = 0;
+
+	appendf(&line, &len, "{\"event\":\"module\",\"action\":\"%s\",\"name\":",
+			loaded ? "load" : "unload");
+	append_json(&line, &len, mod->data.name);
+	appendf(&line, &len, ",\"path\":");
+	append_json(&line, &len, mod->path);
+	appendf(&line, &len, "}\n");
+
+	publish(0, SUB_MODULE, -1, 0, -1, line, len);
+	free(line);
+}
+
+static void notify_setting(char *module_name, struct setting *setting)
+{
+	if (!anyone_wants(SUB_SETTING, -1)) {
+		return;
+	}
+
+	char *line = 0;
+	size_t len = 0;
+
+	appendf(&line, &len, "{\"event\":\"setting\",\"module\":");
+	append_json(&line, &len, module_name);
+	appendf(&line, &len, ",\"name\":");
+	append_json(&line, &len, setting->name);
+	appendf(&line, &len, ",\"value\":");
+
+	switch (setting->type) {
+	case INT:
+		appendf(&line, &len, "%d", setting->val.INT);
+		break;
+	case BOOL:
+		appendf(&line, &len, "%s", setting->val.BOOL ? "true" : "false");
+		break;
+	case STR:
+		append_json(&line, &len, setting->val.STR);
+		break;
+	case COL:
+		appendf(&line, &len, "\"#%02x%02x%02x%02x\"",
+				setting->val.COL[0],
+				setting->val.COL[1],
+				setting->val.COL[2],
+				setting->val.COL[3]);
+		break;
+	case POS:
+		appendf(&line, &len, "\"%s\"",
+				setting->val.POS == LEFT ? "left" :
+				setting->val.POS == RIGHT ? "right" : "center");
+		break;
+	}
+
+	appendf(&line, &len, "}\n");
+
+	publish(0, SUB_SETTING, -1, (long) setting, -1, line, len);
+	free(line);
+}
+
+/* starts sending events once the request that subscribed has been answered,
+ * beginning with the current state of what the client subscribed to
+ */
+static void start_subscription(struct client *cl)
 {
-	signal(SIGPIPE, SIG_IGN);
+	struct subscription *sub = cl->sub;
 
-	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (sockfd < 0) {
-		fprintf(stderr, "Error opening socket\n");
-		return -1;
-	}
+	subscribers = realloc(subscribers,
+			sizeof(*subscribers) * (subscriber_count + 1));
+	subscribers[subscriber_count++] = cl;
 
-	char *socketpath = getenv("BLOCKBAR_SOCKET");
-	if (!socketpath) {
-		socketpath = defsocketpath;
+	if (wants(sub, SUB_OUTPUT, -1)) {
+		send_outputs(cl);
 	}
 
-	struct sockaddr_un sock_addr;
+	for (int i = 0; i < block_count; i++) {
+		struct block *blk = &blocks[i];
 
-	sock_addr.sun_family = AF_UNIX;
-	strcpy(sock_addr.sun_path, socketpath);
+		if (!blk->id) {
+			continue;
+		}
 
-	unlink(socketpath);
-	if (bind(sockfd, (struct sockaddr *) &sock_addr, sizeof(sock_addr)) == -1) {
-		fprintf(stderr, "Error binding socket\n");
-		return -1;
-	}
+		for (int bar = 0; bar < (blk->eachmon ? bar_count : 1); bar++) {
+			if (wants(sub, SUB_CONTENT, blk->id)) {
+				send_content(cl, blk, bar);
+			}
+		}
 
-	if (listen(sockfd, SOMAXCONN) == -1) {
-		fprintf(stderr, "Error listening to socket\n");
-		return -1;
+		for (int bar = 0; bar < bar_count; bar++) {
+			if (wants(sub, SUB_LAYOUT, blk->id)) {
+				send_layout(cl, blk, bar, blk->x[bar],
+						block_width(blk, bar));
+			}
+		}
 	}
 
-	return sockfd;
+	send_events(cl);
 }
 
 #define cmd(x) \
-	static int cmd_##x(int argc, char **argv, int fd)
+	static int cmd_##x(int argc, char **argv, struct client *cl)
 
 #define frprintf(f, fmt, ...) \
-	dprintf(fd, "%c%c", setout, f); \
-	dprintf(fd, fmt, ##__VA_ARGS__);
+	reply(cl, f, fmt, ##__VA_ARGS__)
 
 #define rprintf(fmt, ...) \
 	frprintf(rstdout, fmt, ##__VA_ARGS__)
@@ -128,10 +1002,12 @@ cmd(help)
 #define phelp(key, val) \
 	rprintf("\t%-27s%s\n", key, val)
 
-	rprintf("Usage: %s <command>\n\n", argv[0]);
+	rprintf("Usage: %s <command> | --stdin\n\n", argv[0]);
 	rprintf("Commands:\n");
 	phelp("list", "Lists blocks by their indices and \"exec\" value");
 	phelp("exec <n>", "Executes block's script");
+	phelp("push <n>[:o] <data>", "Sets the data displayed by a block");
+	phelp("click <o> <b> <x>", "Clicks on the bar of an output");
 	phelp("list-properties", "Lists a block's properties");
 	phelp("list-settings", "Lists the bar's settings");
 	phelp("property <n>[:o] <p> [v]", "Gets or sets a property of a block");
@@ -142,10 +1018,15 @@ cmd(help)
 	phelp("move-right <n>", "Moves a block right");
 	phelp("dump [--explicit]", "Dumps the current configuration to stdout");
 	phelp("list-modules", "Lists the loaded modules");
+	phelp("stats", "Reports memory used and updates skipped");
+	phelp("benchmark [frames]", "Times full redraws of every bar");
 	phelp("load-module <file>", "Loads a module");
 	phelp("unload-module <name>", "Unloads a module");
 	phelp("raise <name>", "Raises a render module");
 	phelp("lower <name>", "Lowers a render module");
+	phelp("begin", "Holds back redraws until \"commit\"");
+	phelp("commit", "Draws the changes made since \"begin\"");
+	phelp("subscribe [event]...", "Prints events as they happen");
 
 #undef phelp
 
@@ -194,6 +1075,104 @@ cmd(exec)
 	return 0;
 }
 
+/* Joins the arguments from first onwards with spaces into a new string */
+static char *join_args(int argc, char **argv, int first)
+{
+	size_t size = 1;
+
+	for (int i = first; i < argc; i++) {
+		size += strlen(argv[i]) + 1;
+	}
+
+	char *str = malloc(size);
+	char *p = str;
+
+	for (int i = first; i < argc; i++) {
+		if (i > first) {
+			*p++ = ' ';
+		}
+
+		size_t len = strlen(argv[i]);
+		memcpy(p, argv[i], len);
+		p += len;
+	}
+
+	*p = 0;
+
+	return str;
+}
+
+cmd(push)
+{
+	vars(argc < 4 ? 0 : argc, "<data>", 1);
+
+	char *data = join_args(argc, argv, 3);
+
+	int changed = 0;
+
+	if (!blk->eachmon) {
+		changed = set_exec_data(blk, 0, data);
+	} else {
+		for (int bar = 0; bar < bar_count; bar++) {
+			if (output == -1 || output == bar) {
+				changed |= set_exec_data(blk, bar, strdup(data));
+			}
+		}
+
+		free(data);
+	}
+
+	/* drawn with the next redraw, along with anything else that changed */
+	if (changed) {
+		update_block(blk);
+		exec_redraw_dirty = 1;
+	}
+
+	return 0;
+}
+
+cmd(click)
+{
+	if (argc != 5) {
+		frprintf(rstderr, "Usage: %s %s <output> <button> <x>\n",
+				argv[0], argv[1]);
+		return 1;
+	}
+
+	struct click cd = {.bar = -1};
+
+	for (int i = 0; i < bar_count; i++) {
+		if (strcmp(argv[2], bars[i].output) == 0) {
+			cd.bar = i;
+			break;
+		}
+	}
+
+	if (cd.bar == -1) {
+		frprintf(rstderr, "Output does not exist\n");
+		return 1;
+	}
+
+	char *end;
+
+	cd.button = strtol(argv[3], &end, 0);
+
+	if (*end != 0 || end == argv[3] || cd.button < 1) {
+		frprintf(rstderr, "Invalid button, expecting positive integer\n");
+		return 1;
+	}
+
+	cd.x = strtol(argv[4], &end, 0);
+
+	if (*end != 0 || end == argv[4]) {
+		frprintf(rstderr, "Invalid x coordinate, expecting integer\n");
+		return 1;
+	}
+
+	click(&cd);
+	return 0;
+}
+
 cmd(list_properties)
 {
 	(void) argc;
@@ -247,7 +1226,7 @@ cmd(list_settings)
 	return 0;
 }
 
-static void print_setting(struct setting *setting, int fd)
+static void print_setting(struct setting *setting, struct client *cl)
 {
 	switch (setting->type) {
 	case INT:
@@ -278,7 +1257,8 @@ static void print_setting(struct setting *setting, int fd)
 	}
 }
 
-static int parse_setting(struct setting *setting, char *v, int fd)
+static int parse_setting(struct setting *setting, char *v,
+		struct client *cl)
 {
 	union value val;
 
@@ -365,7 +1345,7 @@ cmd(_get_property)
 			continue;
 		}
 
-		print_setting(property, fd);
+		print_setting(property, cl);
 		return 0;
 	}
 
@@ -373,7 +1353,8 @@ cmd(_get_property)
 	return 1;
 }
 
-cmd(_set_property)
+static int apply_property(int argc, char **argv, struct client *cl,
+		char *str)
 {
 	vars(argc <= 4 ? 0 : argc, "<property> <value>", 1);
 
@@ -383,30 +1364,14 @@ cmd(_set_property)
 		return 1;
 	}
 
-	char str [bbcbuffsize] = {0};
-
-	for (int i = 4; i < argc; i++) {
-		strcat(str, argv[i]);
-		strcat(str, " ");
-	}
-
-	str[strlen(str) - 1] = 0;
-
 	if (strcmp("execdata", argv[3]) == 0) {
-		char **exec_data;
-		if (blk->eachmon) {
-			exec_data = &(blk->data[output].exec_data);
-		} else {
-			exec_data = &(blk->data->exec_data);
-		}
-
-		if (*exec_data) {
-			free(*exec_data);
+		/* set like the output of the block's command, so text that didn't
+		 * change isn't drawn again
+		 */
+		if (!set_exec_data(blk, blk->eachmon ? output : 0, strdup(str))) {
+			return 0;
 		}
 
-		*exec_data = malloc(strlen(str) + 1);
-		strcpy(*exec_data, str);
-
 		goto end;
 	} else {
 		for (int i = 0; i < property_count; i++) {
@@ -425,10 +1390,13 @@ cmd(_set_property)
 				fclose(ferr);
 				frprintf(rstderr, "%s", err);
 #else
-				FILE *file = fdopen(fd, "w");
-				dprintf(fd, "%c%c", setout, rstdout);
+				FILE *file = tmpfile();
+				if (!file) {
+					frprintf(rstderr, "Error creating temporary file\n");
+					return 1;
+				}
 				int ret = module_register_block(blk, str, file);
-				fflush(file);
+				reply_file(cl, file);
 #endif
 				if (ret == 0) {
 					goto end;
@@ -437,13 +1405,33 @@ cmd(_set_property)
 				}
 			}
 
-			int r = parse_setting(property, str, fd);
+			int r = parse_setting(property, str, cl);
 
 			if (r == 0) {
-				if (property == &(blk->properties.interval)) {
+				if (property == &(blk->properties.interval) ||
+						property == &(blk->properties.schedule) ||
+						property == &(blk->properties.persist)) {
 					update_block_task(blk);
 				}
 
+				if (property == &(blk->properties.exec) ||
+						property == &(blk->properties.shell)) {
+					update_block_argv(blk);
+				}
+
+				if (property == &(blk->properties.pos)) {
+					invalidate_layout(-1);
+				}
+
+				if (property == &(blk->properties.exec) ||
+						property == &(blk->properties.persist)) {
+					block_kill(blk);
+
+					if (blk->properties.persist.val.BOOL) {
+						block_exec(blk, 0);
+					}
+				}
+
 				goto end;
 			} else if (r == 1) {
 				return 1;
@@ -455,17 +1443,28 @@ cmd(_set_property)
 	return 1;
 
 end:
-	redraw_block(blk);
-	redraw();
+	update_block(blk);
+	update_bars();
 	return 0;
 }
 
+/* the value may be as long as a request, so it isn't kept on the stack */
+cmd(_set_property)
+{
+	char *str = join_args(argc, argv, 4);
+	int ret = apply_property(argc, argv, cl, str);
+
+	free(str);
+
+	return ret;
+}
+
 cmd(property)
 {
 	if (argc == 4) {
-		return cmd__get_property(argc, argv, fd);
+		return cmd__get_property(argc, argv, cl);
 	} else if (argc >= 5) {
-		return cmd__set_property(argc, argv, fd);
+		return cmd__set_property(argc, argv, cl);
 	} else {
 		frprintf(rstderr, "Usage: %s %s <index>[:output] <property> [value]\n",
 				argv[0], argv[1]);
@@ -506,7 +1505,7 @@ cmd(_get_setting)
 				continue;
 			}
 
-			print_setting(setting, fd);
+			print_setting(setting, cl);
 			return 0;
 		}
 
@@ -523,7 +1522,7 @@ cmd(_get_setting)
 			continue;
 		}
 
-		print_setting(setting, fd);
+		print_setting(setting, cl);
 		return 0;
 	}
 
@@ -531,17 +1530,8 @@ cmd(_get_setting)
 	return 1;
 }
 
-cmd(_set_setting)
+static int apply_setting(char **argv, struct client *cl, char *str)
 {
-	char str [bbcbuffsize] = {0};
-
-	for (int i = 3; i < argc; i++) {
-		strcat(str, argv[i]);
-		strcat(str, " ");
-	}
-
-	str[strlen(str) - 1] = 0;
-
 	char *colon = strchr(argv[2], ':');
 
 	char *module_name;
@@ -567,10 +1557,12 @@ cmd(_set_setting)
 		for (int i = 0; i < mod->data.setting_count; i++) {
 			struct setting *setting = &mod->data.settings[i];
 			if (strcmp(setting_name, setting->name) == 0) {
-				int r = parse_setting(setting, str, fd);
+				int r = parse_setting(setting, str, cl);
 
 				if (r == 0) {
-					redraw();
+					notify_setting(module_name, setting);
+					damage_all();
+					update_bars();
 
 					return 0;
 				} else {
@@ -592,19 +1584,46 @@ cmd(_set_setting)
 		struct setting *setting = &((struct setting *) &settings)[i];
 
 		if (strcmp(setting_name, setting->name) == 0) {
-			int r = parse_setting(setting, str, fd);
+			int r = parse_setting(setting, str, cl);
 
 			if (r == 0) {
+				notify_setting(0, setting);
+
 				if (0
 					E(height)
 					E(marginvert)
 					E(marginhoriz)
 					E(xoffset)
 					E(position)) {
-					update_geom();
+					if (txn.open) {
+						txn.geom = 1;
+					} else {
+						update_geom();
+					}
+				}
+
+				if (0
+					E(schedule)
+					E(timerslack)) {
+					for (int j = 0; j < block_count; j++) {
+						if (blocks[j].id) {
+							update_block_task(&blocks[j]);
+						}
+					}
+
+					for (int j = 0; j < module_count; j++) {
+						if (modules[j].dl) {
+							update_module_task(&modules[j]);
+						}
+					}
+				}
+
+				if (0
+					E(threads)) {
+					pool_init(settings.threads.val.INT);
 				}
 
-#ifndef WAYLAND
+#if !defined(WAYLAND) && !defined(HEADLESS)
 				if (0
 					E(height)
 					E(marginhoriz)
@@ -612,25 +1631,26 @@ cmd(_set_setting)
 					E(traypadding)
 					E(trayiconsize)
 					E(trayside)) {
-					redraw_tray();
+					if (txn.open) {
+						txn.tray = 1;
+					} else {
+						redraw_tray();
+					}
 				}
 
 				if (0
 					E(background)
 					E(traybar)) {
-					reparent_icons();
-				}
-#endif
-
-				for (int j = 0; j < block_count; j++) {
-					struct block *blk = &blocks[j];
-
-					if (blk->id) {
-						redraw_block(blk);
+					if (txn.open) {
+						txn.icons = 1;
+					} else {
+						reparent_icons();
 					}
 				}
+#endif
 
-				redraw();
+				update_all_blocks();
+				update_bars();
 
 				return 0;
 			} else if (r == 1) {
@@ -644,12 +1664,22 @@ cmd(_set_setting)
 	return 1;
 }
 
+cmd(_set_setting)
+{
+	char *str = join_args(argc, argv, 3);
+	int ret = apply_setting(argv, cl, str);
+
+	free(str);
+
+	return ret;
+}
+
 cmd(setting)
 {
 	if (argc == 3) {
-		return cmd__get_setting(argc, argv, fd);
+		return cmd__get_setting(argc, argv, cl);
 	} else if (argc >= 4) {
-		return cmd__set_setting(argc, argv, fd);
+		return cmd__set_setting(argc, argv, cl);
 	} else {
 		frprintf(rstderr, "Usage: %s %s [module:]<setting> [value]\n",
 				argv[0], argv[1]);
@@ -687,7 +1717,7 @@ cmd(rm)
 
 	remove_block(blk);
 
-	redraw();
+	update_bars();
 
 	return 0;
 }
@@ -731,7 +1761,8 @@ cmd(move_left)
 	memcpy(swp, blk, sizeof(struct block));
 	memcpy(blk, &tmp, sizeof(struct block));
 
-	redraw();
+	invalidate_layout(-1);
+	update_bars();
 
 	return 0;
 }
@@ -775,7 +1806,8 @@ cmd(move_right)
 	memcpy(swp, blk, sizeof(struct block));
 	memcpy(blk, &tmp, sizeof(struct block));
 
-	redraw();
+	invalidate_layout(-1);
+	update_bars();
 
 	return 0;
 
@@ -793,51 +1825,279 @@ cmd(dump)
 		explicit = 1;
 	}
 
-	FILE *file = fdopen(fd, "w");
+	FILE *file = tmpfile();
+
+	if (!file) {
+		frprintf(rstderr, "Error creating temporary file\n");
+		return 1;
+	}
 
-	dprintf(fd, "%c%c", setout, rstdout);
 	char *err = config_save(file, explicit);
+	reply_file(cl, file);
+
+	if (err) {
+		frprintf(rstderr, "Error dumping config:\n%s\n", err);
+		free(err);
+		return 1;
+	}
+
+	rprintf("\n");
+
+	return 0;
+}
+
+cmd(list_modules)
+{
+	(void) argc;
+	(void) argv;
+
+	unsigned int width = 0;
+
+	for (int i = 0; i < module_count; i++) {
+		struct module *mod = &modules[i];
+
+		if (!mod->dl) {
+			continue;
+		}
+
+		if (strlen(mod->data.name) > width) {
+			width = strlen(mod->data.name);
+		}
+	}
+
+	for (int i = 0; i < module_count; i++) {
+		struct module *mod = &modules[i];
+
+		if (!mod->dl) {
+			continue;
+		}
+
+		rprintf("%-*s%s\n", width + 2, mod->data.name, mod->path);
+	}
+
+	return 0;
+}
+
+static size_t surface_bytes(cairo_surface_t *sfc)
+{
+	return (size_t) cairo_image_surface_get_stride(sfc) *
+		cairo_image_surface_get_height(sfc);
+}
+
+cmd(stats)
+{
+	(void) argc;
+	(void) argv;
+
+	int bar_sfcs = 0, block_sfcs = 0, module_sfcs = 0;
+	size_t bar_bytes = 0, block_bytes = 0, module_bytes = 0;
+
+	for (int bar = 0; bar < bar_count; bar++) {
+		if (bars[bar].sfc) {
+			bar_sfcs++;
+			bar_bytes += surface_bytes(bars[bar].sfc);
+		}
+
+		if (bars[bar].chrome) {
+			bar_sfcs++;
+			bar_bytes += surface_bytes(bars[bar].chrome);
+		}
+
+#ifdef WAYLAND
+		for (int i = 0; i < bars[bar].buffer_count; i++) {
+			bar_sfcs++;
+			bar_bytes += bars[bar].buffers[i].size;
+		}
+#endif
+	}
+
+	for (int i = 0; i < block_count; i++) {
+		struct block *blk = &blocks[i];
+
+		if (!blk->id) {
+			continue;
+		}
+
+		for (int bar = 0; bar < bar_count; bar++) {
+			if (blk->sfc[bar]) {
+				block_sfcs++;
+				block_bytes += surface_bytes(blk->sfc[bar]);
+			}
+		}
+	}
+
+	for (int i = 0; i < module_count; i++) {
+		struct module *mod = &modules[i];
+
+		if (!mod->dl || mod->data.type != RENDER) {
+			continue;
+		}
+
+		for (int bar = 0; bar < bar_count; bar++) {
+			if (mod->sfc[bar]) {
+				module_sfcs++;
+				module_bytes += surface_bytes(mod->sfc[bar]);
+			}
+		}
+	}
+
+	rprintf("%-16s%10s%14s\n", "", "surfaces", "bytes");
+	rprintf("%-16s%10d%14zu\n", "bars", bar_sfcs, bar_bytes);
+	rprintf("%-16s%10d%14zu\n", "blocks", block_sfcs, block_bytes);
+	rprintf("%-16s%10d%14zu\n", "modules", module_sfcs, module_bytes);
+	rprintf("%-16s%10d%14zu\n", "total",
+			bar_sfcs + block_sfcs + module_sfcs,
+			bar_bytes + block_bytes + module_bytes);
+
+	rprintf("\n");
+	rprintf("%-16s%10lu\n", "updates", exec_updates);
+	rprintf("%-16s%10lu\n", "unchanged", exec_unchanged);
+
+	return 0;
+}
+
+cmd(benchmark)
+{
+	int frames = 100;
+
+	if (argc == 3) {
+		frames = atoi(argv[2]);
+	}
+
+	if (argc > 3 || frames <= 0) {
+		frprintf(rstderr, "Usage: %s %s [frames]\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	int width = 0;
+
+	for (int i = 0; i < bar_count; i++) {
+		width += bars[i].width;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < frames; i++) {
+		damage_all();
+		redraw();
+
+#if !defined(WAYLAND) && !defined(HEADLESS)
+		/* a frame is done once the server has copied it to the windows */
+		XSync(disp, False);
+#endif
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double ms = (end.tv_sec - start.tv_sec) * 1000.0 +
+		(end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+	rprintf("%d frames on %d bars, %d pixels wide in total\n",
+			frames, bar_count, width);
+#if !defined(WAYLAND) && !defined(HEADLESS)
+	rprintf("presented with %s\n",
+			bar_count > 0 && bars[0].image ? "MIT-SHM" : "Xlib");
+#endif
+	rprintf("%.3f ms per frame\n", ms / frames);
+
+	return 0;
+}
+
+cmd(begin)
+{
+	(void) argc;
+	(void) argv;
 
-	if (err) {
-		frprintf(rstderr, "Error dumping config:\n%s\n", err);
-		free(err);
+	if (txn.open) {
+		frprintf(rstderr, "A transaction is already open\n");
 		return 1;
 	}
 
-	rprintf("\n");
+	txn.open = 1;
 
 	return 0;
 }
 
-cmd(list_modules)
+cmd(commit)
 {
 	(void) argc;
 	(void) argv;
 
-	unsigned int width = 0;
+	if (!txn.open) {
+		frprintf(rstderr, "No transaction is open\n");
+		return 1;
+	}
 
-	for (int i = 0; i < module_count; i++) {
-		struct module *mod = &modules[i];
+	int failed = txn.failed;
 
-		if (!mod->dl) {
-			continue;
-		}
+	if (txn.skipped) {
+		frprintf(rstderr, "%d command%s after the failed command %s not run\n",
+				txn.skipped, txn.skipped == 1 ? "" : "s",
+				txn.skipped == 1 ? "was" : "were");
+	}
 
-		if (strlen(mod->data.name) > width) {
-			width = strlen(mod->data.name);
-		}
+	commit_txn();
+
+	return failed;
+}
+
+cmd(subscribe)
+{
+	if (cl->sub) {
+		frprintf(rstderr, "Already subscribed\n");
+		return 1;
 	}
 
-	for (int i = 0; i < module_count; i++) {
-		struct module *mod = &modules[i];
+	struct subscription *sub = calloc(1, sizeof(struct subscription));
 
-		if (!mod->dl) {
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "--block") == 0) {
+			char *end;
+			int id = i + 1 < argc ? strtol(argv[i + 1], &end, 0) : 0;
+
+			if (id <= 0 || *end != 0) {
+				frprintf(rstderr, "Usage: %s %s [event]... "
+						"[--block <index>]...\n", argv[0], argv[1]);
+				free(sub->blocks);
+				free(sub);
+				return 1;
+			}
+
+			sub->blocks = realloc(sub->blocks,
+					sizeof(int) * (sub->block_count + 1));
+			sub->blocks[sub->block_count++] = id;
+			i++;
 			continue;
 		}
 
-		rprintf("%-*s%s\n", width + 2, mod->data.name, mod->path)
+		int type;
+
+		for (type = 0; type < SUB_TYPES; type++) {
+			if (strcmp(argv[i], sub_names[type]) == 0) {
+				break;
+			}
+		}
+
+		if (type == SUB_TYPES) {
+			frprintf(rstderr, "Unknown event \"%s\"\n", argv[i]);
+			free(sub->blocks);
+			free(sub);
+			return 1;
+		}
+
+		sub->types |= 1 << type;
+	}
+
+	if (sub->types == 0) {
+		sub->types = (1 << SUB_TYPES) - 1;
 	}
 
+	cl->sub = sub;
+
+	/* events are written to stdout */
+	begin_output(cl, rstdout);
+
 	return 0;
 }
 
@@ -864,10 +2124,13 @@ cmd(load_module)
 	frprintf(rstderr, "%s", err);
 	rprintf("%s", out);
 #else
-	FILE *file = fdopen(fd, "w");
-	dprintf(fd, "%c%c", setout, rstdout);
+	FILE *file = tmpfile();
+	if (!file) {
+		frprintf(rstderr, "Error creating temporary file\n");
+		return 1;
+	}
 	struct module *ret = load_module(argv[2], -1, file, file);
-	fflush(file);
+	reply_file(cl, file);
 #endif
 
 	return ret == 0;
@@ -884,6 +2147,7 @@ cmd(unload_module)
 
 	if (mod) {
 		unload_module(mod);
+		damage_all();
 
 		for (int i = 0; i < block_count; i++) {
 			struct block *blk = &blocks[i];
@@ -949,6 +2213,7 @@ cmd(raise_lower)
 		position_module(mod, -1, 1);
 	}
 
+	damage_all();
 	redraw();
 
 	return 0;
@@ -956,118 +2221,397 @@ cmd(raise_lower)
 
 #define _CASE(x, y) \
 	else if (strcmp(argv[1], x) == 0) { \
-		ret = cmd_##y(argc, argv, fd); \
+		ret = cmd_##y(argc, argv, cl); \
 	}
 
 #define CASE(x) \
 	_CASE(#x, x)
 
-void socket_recv(int sockfd)
+static int run_command(int argc, char **argv, struct client *cl)
+{
+	int ret;
+
+	if (argc < 2) {
+		frprintf(rstderr, "No command specified\n");
+		return 1;
+	}
+
+	if (0) {}
+	_CASE("--help", help)
+	CASE(list)
+	CASE(exec)
+	CASE(push)
+	CASE(click)
+	_CASE("list-properties", list_properties)
+	_CASE("list-settings", list_settings)
+	CASE(property)
+	CASE(setting)
+	CASE(new)
+	CASE(rm)
+	_CASE("move-left", move_left)
+	_CASE("move-right", move_right)
+	CASE(dump)
+	_CASE("list-modules", list_modules)
+	CASE(stats)
+	CASE(benchmark)
+	_CASE("load-module", load_module)
+	_CASE("unload-module", unload_module)
+	_CASE("raise", raise_lower)
+	_CASE("lower", raise_lower)
+	CASE(begin)
+	CASE(commit)
+	CASE(subscribe)
+	else {
+		frprintf(rstderr, "Unknown command\n");
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/* a request that doesn't fit in this is refused */
+#define MAX_REQUEST (16 << 20)
+
+/* how much is read from a client before the main loop gets to run again */
+#define READS_PER_EVENT 16
+
+/* answers a request that can't be run */
+static void refuse(struct client *cl, const char *why)
+{
+	if (cl->version != 1 && cl->out_len == 0) {
+		char version = bbcversion;
+		reply_frame(cl, framehello, &version, 1);
+	}
+
+	frprintf(rstderr, "%s\n", why);
+	reply_ret(cl, 1);
+}
+
+static size_t frame_length(const char *head)
 {
-	int fd = accept(sockfd, NULL, 0);
+	const unsigned char *h = (const unsigned char *) head;
+
+	return h[1] | h[2] << 8 | h[3] << 16 | (size_t) h[4] << 24;
+}
 
-	long len = 0;
-	char *cmd = 0;
+/* Splits a version 1 request into its arguments, with a null pointer between
+ * each command, and returns how many there are
+ */
+static int split_request(struct client *cl, char ***argvp)
+{
+	char *cmd = cl->in;
+	long len = cl->in_len;
 
 	int argc = 1;
 	char **argv;
 
-	char msg [bbcbuffsize];
+	/* strip the last argument's terminator and the end of transmission */
+	if (len >= 2 && cmd[len - 1] == '\x04') {
+		len -= 2;
+	}
+
+	cmd[len] = 0;
+
+	for (int i = 0; i < len; i++) {
+		if (cmd[i] == 0) {
+			argc++;
+		}
+	}
+
+	argv = malloc(sizeof(char *) * argc);
+
+	argc = 0;
+
+	argv[argc++] = cmd;
+
+	for (int i = 0; i < len; i++) {
+		if (cmd[i] == 0) {
+			argv[argc++] = cmd + i + 1;
+		}
+	}
+
+	/* a connection may carry several commands, which are separated by an
+	 * argument that only contains nextcmd
+	 */
+	for (int i = 0; i < argc; i++) {
+		if (argv[i][0] == nextcmd && argv[i][1] == 0) {
+			argv[i] = 0;
+		}
+	}
+
+	*argvp = argv;
+	return argc;
+}
+
+/* Does the same for a framed request, and answers its hello frame. Returns -1
+ * if the request is malformed.
+ */
+static int split_frames(struct client *cl, char ***argvp)
+{
+	char **argv = 0;
+	int argc = 0;
+
+	for (size_t pos = 0; pos < cl->in_framed;) {
+		char *data = cl->in + pos + framehead;
+		size_t len = frame_length(cl->in + pos);
+		int type = cl->in[pos];
+
+		pos += framehead + len;
+
+		/* the request has to start with a hello frame */
+		if ((type == framehello) != (pos == framehead + len)) {
+			goto malformed;
+		}
+
+		if (type == framehello) {
+			if (len != strlen(bbcmagic) + 1 ||
+					memcmp(data, bbcmagic, len - 1) != 0) {
+				goto malformed;
+			}
+
+			char version = data[len - 1] < bbcversion ?
+				data[len - 1] : bbcversion;
+
+			reply_frame(cl, framehello, &version, 1);
+			continue;
+		}
+
+		if (type != framecmd) {
+			continue;
+		}
+
+		/* every argument ends with a NUL byte */
+		if (len == 0 || data[len - 1] != 0) {
+			goto malformed;
+		}
+
+		int count = argc > 0;
+
+		for (size_t i = 0; i < len; i++) {
+			count += data[i] == 0;
+		}
+
+		argv = realloc(argv, sizeof(char *) * (argc + count));
+
+		if (argc > 0) {
+			argv[argc++] = 0;
+		}
+
+		for (char *arg = data; arg < data + len; arg += strlen(arg) + 1) {
+			argv[argc++] = arg;
+		}
+	}
+
+	*argvp = argv;
+	return argc;
+
+malformed:
+	free(argv);
+	return -1;
+}
+
+static void run_request(struct client *cl)
+{
+	char **argv;
+	int argc;
 
 	int ret;
 
-	if (fd == -1) {
+	if (cl->version == 1) {
+		argc = split_request(cl, &argv);
+	} else {
+		argc = split_frames(cl, &argv);
+	}
+
+	if (argc == -1) {
+		refuse(cl, "Malformed request");
 		return;
 	}
 
-	struct pollfd fds [] = {
-		{fd, POLLIN | POLLHUP, 0},
-	};
+	/* all of the commands are run before the main loop continues, so a
+	 * transaction never spans more than one request
+	 */
+	ret = 0;
+	int start = 0;
 
-	while (poll(fds, 1, 5) > 0) {
-		if (fds[0].revents & (POLLERR | POLLHUP)) {
-			break;
+	for (int i = 0; i <= argc; i++) {
+		if (i < argc && argv[i]) {
+			continue;
 		}
 
-		if (!(fds[0].revents & POLLIN)) {
-			continue;
+		int r;
+
+		if (txn.failed && !(i - start >= 2 &&
+					strcmp(argv[start + 1], "commit") == 0)) {
+			txn.skipped++;
+			r = 0;
+		} else {
+			r = run_command(i - start, argv + start, cl);
 		}
 
-		int n = read(fd, msg, sizeof(msg));
+		if (r != 0) {
+			if (ret == 0) {
+				ret = r;
+			}
 
-		if (n <= 0) {
-			break;
+			if (txn.open) {
+				txn.failed = r;
+			}
 		}
 
-		cmd = realloc(cmd, len + n + 1);
-		memcpy(cmd + len, msg, n);
+		start = i + 1;
+	}
+
+	/* a transaction doesn't outlive its connection */
+	if (txn.open) {
+		commit_txn();
+	}
+
+	/* a subscriber's reply doesn't end until it disconnects */
+	if (!cl->sub) {
+		reply_ret(cl, ret);
+	}
+
+	free(argv);
+}
 
-		len += n;
+/* returns 1 once the frame that ends a framed request has been read */
+static int read_frames(struct client *cl)
+{
+	while (cl->in_len - cl->in_framed >= framehead) {
+		char *head = cl->in + cl->in_framed;
+		size_t len = frame_length(head);
 
-		if (msg[n - 1] == '\x04') {
-			len -= 2;
+		if (cl->in_len - cl->in_framed - framehead < len) {
 			break;
 		}
 
-		cmd[len] = 0;
+		cl->in_framed += framehead + len;
+
+		if (head[0] == frameend) {
+			return 1;
+		}
 	}
 
-	if (!cmd) {
-		close(fd);
+	return 0;
+}
+
+static void client_ready(int fd, void *data)
+{
+	struct client *cl = data;
+
+	char msg [bbcbuffsize];
+	int complete = 0;
+
+	/* subscribers are only read from to find out when they disconnect */
+	if (cl->sub) {
+		ssize_t n;
+
+		while ((n = read(fd, msg, sizeof(msg))) > 0);
+
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != EINTR)) {
+			close_client(cl);
+		} else {
+			send_events(cl);
+		}
+
 		return;
 	}
 
-	for (int i = 0; i < len; i++) {
-		if (cmd[i] == 0) {
-			argc++;
+	if (cl->out) {
+		if (flush_client(cl) != 1) {
+			close_client(cl);
 		}
+
+		return;
 	}
 
-	argv = malloc(sizeof(char *) * argc);
+	for (int i = 0; i < READS_PER_EVENT && !complete; i++) {
+		ssize_t n = read(fd, msg, sizeof(msg));
 
-	argc = 0;
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
 
-	argv[argc++] = cmd;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				close_client(cl);
+			}
 
-	for (int i = 0; i < len; i++) {
-		if (cmd[i] == 0) {
-			argv[argc++] = cmd + i + 1;
+			return;
+		}
+
+		/* a client that stops sending early gets what it sent run */
+		if (n == 0) {
+			if (cl->in_len == 0) {
+				close_client(cl);
+				return;
+			}
+
+			complete = 1;
+			break;
+		}
+
+		/* clients that don't start with a hello frame use version 1 */
+		if (cl->version == 0) {
+			cl->version = msg[0] == framehello ? bbcversion : 1;
+		}
+
+		if (cl->in_len + n > MAX_REQUEST) {
+			refuse(cl, "Request is too large");
+			break;
+		}
+
+		cl->in = realloc(cl->in, cl->in_len + n + 1);
+		memcpy(cl->in + cl->in_len, msg, n);
+		cl->in_len += n;
+
+		if (cl->version == 1) {
+			complete = msg[n - 1] == '\x04';
+		} else {
+			complete = read_frames(cl);
 		}
 	}
 
-	if (argc < 2) {
-		frprintf(rstderr, "No command specified\n");
-		ret = 1;
-		goto end;
+	if (complete) {
+		run_request(cl);
+	} else if (!cl->out) {
+		/* the rest of the request is read once the main loop has run */
+		return;
 	}
 
-	if (0) {}
-	_CASE("--help", help)
-	CASE(list)
-	CASE(exec)
-	_CASE("list-properties", list_properties)
-	_CASE("list-settings", list_settings)
-	CASE(property)
-	CASE(setting)
-	CASE(new)
-	CASE(rm)
-	_CASE("move-left", move_left)
-	_CASE("move-right", move_right)
-	CASE(dump)
-	_CASE("list-modules", list_modules)
-	_CASE("load-module", load_module)
-	_CASE("unload-module", unload_module)
-	_CASE("raise", raise_lower)
-	_CASE("lower", raise_lower)
-	else {
-		frprintf(rstderr, "Unknown command\n");
-		ret = 1;
+	if (cl->sub) {
+		start_subscription(cl);
+		return;
 	}
 
-end:
-	dprintf(fd, "%c%c", setret, ret);
+	if (flush_client(cl) == 1) {
+		event_modify(fd, EVENT_WRITE);
+	} else {
+		close_client(cl);
+	}
+}
 
-	free(cmd);
-	free(argv);
-	close(fd);
+void socket_accept(int sockfd)
+{
+	while (1) {
+		int fd = accept4(sockfd, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return;
+		}
+
+		struct client *cl = calloc(1, sizeof(struct client));
+		cl->fd = fd;
+
+		if (event_add(fd, client_ready, cl) != 0) {
+			close(fd);
+			free(cl);
+		}
+	}
 }
@@ -20,7 +20,16 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include "types.h"
+
 int socket_init();
-void socket_recv(int sockfd);
+void socket_accept(int sockfd);
+
+/* events for subscribers */
+void notify_content(struct block *blk, int bar);
+void notify_click(struct block *blk, struct click *cd);
+void notify_layout(int bar);
+void notify_outputs();
+void notify_module(struct module *mod, int loaded);
 
 #endif /* SOCKET_H */
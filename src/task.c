@@ -18,157 +18,385 @@
  */
 
 #include "task.h"
+#include "config.h"
 #include "util.h"
-#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOT_BITS 16
+#define SLOT_MASK ((1 << SLOT_BITS) - 1)
+#define MAX_GEN (INT32_MAX >> SLOT_BITS)
 
 static struct Task *tasks;
 static int task_count;
 
-static int id;
+static int *free_slots;
+static int free_count;
+
+static int *heap;
+static int heap_count;
+
+static int timerfd = -1;
+static struct timeval armed;
+
+#define BEFORE(a, b) timercmp(&tasks[a].expires, &tasks[b].expires, <)
+
+static const char *mode_strings [] = {
+	"relative",
+	"absolute",
+	"aligned",
+};
+
+static void heap_set(int pos, int slot)
+{
+	heap[pos] = slot;
+	tasks[slot].heap = pos;
+}
 
-int schedule_task(void (*callback)(int id), int interval, int repeat)
+static void sift_up(int pos)
 {
-	struct Task *t = 0;
+	int slot = heap[pos];
+
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
 
-	for (int i = 0; i < task_count; i++) {
-		struct Task *task = &tasks[i];
-		if (task->id == 0) {
-			t = task;
+		if (!BEFORE(slot, heap[parent])) {
 			break;
 		}
-	}
 
-	if (!t) {
-		tasks = realloc(tasks, sizeof(struct Task) * ++task_count);
-		t = &tasks[task_count - 1];
+		heap_set(pos, heap[parent]);
+		pos = parent;
 	}
 
-	memset(t, 0, sizeof(struct Task));
+	heap_set(pos, slot);
+}
+
+static void sift_down(int pos)
+{
+	int slot = heap[pos];
+
+	while (1) {
+		int child = pos * 2 + 1;
 
-	while (!t->id) {
-start:
-		id++;
+		if (child >= heap_count) {
+			break;
+		}
 
-		if (id == INT_MAX) {
-			id = 1;
+		if (child + 1 < heap_count && BEFORE(heap[child + 1], heap[child])) {
+			child++;
 		}
 
-		for (int i = 0; i < task_count; i++) {
-			if (tasks[i].id == id) {
-				goto start;
-			}
+		if (!BEFORE(heap[child], slot)) {
+			break;
 		}
 
-		t->id = id;
+		heap_set(pos, heap[child]);
+		pos = child;
 	}
 
-	t->callback = callback;
-	t->interval = interval;
-	t->repeat = repeat;
-	get_time(&t->start);
+	heap_set(pos, slot);
+}
 
-	return t->id;
+static void heap_push(int slot)
+{
+	heap[heap_count] = slot;
+	tasks[slot].heap = heap_count++;
+	sift_up(heap_count - 1);
 }
 
-void cancel_task(int id)
+static void heap_remove(int pos)
 {
-	for (int i = 0; i < task_count; i++) {
-		if (tasks[i].id == id) {
-			tasks[i].id = 0;
+	int last = heap[--heap_count];
+
+	if (pos == heap_count) {
+		return;
+	}
+
+	heap_set(pos, last);
+
+	if (pos > 0 && BEFORE(last, heap[(pos - 1) / 2])) {
+		sift_up(pos);
+	} else {
+		sift_down(pos);
+	}
+}
+
+static void arm_timer()
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+
+	if (heap_count) {
+		struct timeval *next = &tasks[heap[0]].expires;
+
+		if (timercmp(next, &armed, ==)) {
+			return;
+		}
+
+		armed = *next;
+
+		its.it_value.tv_sec = armed.tv_sec;
+		its.it_value.tv_nsec = armed.tv_usec * 1000;
+
+		/* an all-zero it_value would disarm the timer */
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec) {
+			its.it_value.tv_nsec = 1;
+		}
+	} else {
+		if (!timerisset(&armed)) {
+			return;
 		}
+
+		timerclear(&armed);
+	}
+
+	if (timerfd != -1) {
+		timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, 0);
 	}
 }
 
-#define TIMEDIFF(a, b) (long) (((b.tv_sec - a.tv_sec) * 1000000) \
-		+ (b.tv_usec - a.tv_usec))
+static struct Task *lookup(int id)
+{
+	int slot = (id & SLOT_MASK) - 1;
+
+	if (id <= 0 || slot >= task_count || tasks[slot].id != id) {
+		return 0;
+	}
 
-struct timeval get_time_to_next_task()
+	return &tasks[slot];
+}
+
+static void interval_to_timeval(long long interval, struct timeval *tv)
 {
-	int i;
-	struct timeval ret, now, interval;
+	tv->tv_sec = interval / 1000;
+	tv->tv_usec = (interval % 1000) * 1000;
+}
 
-	ret.tv_sec = ret.tv_usec = -1;
+/* time from now until the next multiple of the interval on the local clock */
+static long long time_to_boundary(int interval)
+{
+	struct timespec ts;
+	struct tm tm;
 
-	for (i = 0; i < task_count; i++) {
-		if (tasks[i].id) {
-			interval.tv_sec = tasks[i].interval / 1000;
-			interval.tv_usec = (tasks[i].interval % 1000) * 1000;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	localtime_r(&ts.tv_sec, &tm);
 
-			timeradd(&tasks[i].start, &interval, &ret);
+	long long usec = (ts.tv_sec + tm.tm_gmtoff) * 1000000LL
+		+ ts.tv_nsec / 1000;
+	long long period = interval * 1000LL;
+
+	return period - usec % period;
+}
+
+static void set_deadline(struct Task *t, struct timeval *now, int fired)
+{
+	struct timeval interval;
+	interval_to_timeval(t->interval, &interval);
+
+	switch (t->mode) {
+	case TASK_RELATIVE:
+		timeradd(now, &interval, &t->deadline);
+		break;
+	case TASK_ABSOLUTE:
+		if (!fired) {
+			timeradd(now, &interval, &t->deadline);
 			break;
 		}
+
+		timeradd(&t->deadline, &interval, &t->deadline);
+
+		/* skip any periods that were missed entirely */
+		if (!timercmp(&t->deadline, now, >)) {
+			long long behind = (now->tv_sec - t->deadline.tv_sec)
+				* 1000000LL + now->tv_usec - t->deadline.tv_usec;
+			long long skip = (behind / (t->interval * 1000LL) + 1)
+				* t->interval;
+
+			interval_to_timeval(skip, &interval);
+			timeradd(&t->deadline, &interval, &t->deadline);
+		}
+		break;
+	case TASK_ALIGNED:
+	{
+		long long usec = time_to_boundary(t->interval);
+
+		/* the wall clock can lag the timer slightly, so a boundary that
+		 * is very close is the one that has just fired */
+		if (fired && usec * 8 < t->interval * 1000LL) {
+			usec += t->interval * 1000LL;
+		}
+
+		interval.tv_sec = usec / 1000000;
+		interval.tv_usec = usec % 1000000;
+
+		timeradd(now, &interval, &t->deadline);
+		break;
+	}
+	case TASK_MODES:
+		break;
+	}
+
+	t->expires = t->deadline;
+
+	int slack = settings.timerslack.val.INT;
+
+	/* round up so that deadlines in the same window share a wakeup */
+	if (slack > 0) {
+		long long period = slack * 1000LL;
+		long long usec = t->deadline.tv_sec * 1000000LL
+			+ t->deadline.tv_usec;
+
+		usec += period - 1;
+		usec -= usec % period;
+
+		t->expires.tv_sec = usec / 1000000;
+		t->expires.tv_usec = usec % 1000000;
 	}
+}
 
-	for (i++; i < task_count; i++) {
-		if (!tasks[i].id) {
-			continue;
+int parse_task_mode(const char *str)
+{
+	for (int i = 0; i < TASK_MODES; i++) {
+		if (strcmp(str, mode_strings[i]) == 0) {
+			return i;
 		}
+	}
 
-		struct timeval t = tasks[i].start;
+	return -1;
+}
 
-		interval.tv_sec = tasks[i].interval / 1000;
-		interval.tv_usec = (tasks[i].interval % 1000) * 1000;
+int task_init()
+{
+	timerfd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
 
-		timeradd(&t, &interval, &t);
+	if (timerfd == -1) {
+		perror("timerfd_create");
+	}
 
-		if (t.tv_sec * 1000000 + t.tv_usec <
-				ret.tv_sec * 1000000 + ret.tv_usec) {
-			ret = t;
+	return timerfd;
+}
+
+int schedule_task(void (*callback)(int id), int interval, int repeat,
+		enum task_mode mode)
+{
+	int slot;
+
+	if (free_count) {
+		slot = free_slots[--free_count];
+	} else {
+		if (task_count == SLOT_MASK) {
+			fprintf(stderr, "Too many tasks scheduled\n");
+			return 0;
 		}
+
+		slot = task_count++;
+
+		tasks = realloc(tasks, sizeof(struct Task) * task_count);
+		heap = realloc(heap, sizeof(int) * task_count);
+		free_slots = realloc(free_slots, sizeof(int) * task_count);
+
+		memset(&tasks[slot], 0, sizeof(struct Task));
 	}
 
-	get_time(&now);
+	struct Task *t = &tasks[slot];
 
-	if (ret.tv_sec || ret.tv_usec) {
-		timersub(&ret, &now, &ret);
+	if (++t->gen > MAX_GEN) {
+		t->gen = 1;
 	}
 
-	if (ret.tv_sec < 0) {
-		ret.tv_sec = ret.tv_usec = 0;
+	t->id = (t->gen << SLOT_BITS) | (slot + 1);
+	t->callback = callback;
+	t->interval = interval > 0 ? interval : 1;
+	t->repeat = repeat;
+	t->mode = mode;
+
+	struct timeval now;
+	get_time(&now);
+	set_deadline(t, &now, 0);
+
+	heap_push(slot);
+	arm_timer();
+
+	return t->id;
+}
+
+void cancel_task(int id)
+{
+	struct Task *t = lookup(id);
+
+	if (!t) {
+		return;
 	}
 
-	return ret;
+	heap_remove(t->heap);
+
+	t->id = 0;
+	free_slots[free_count++] = t - tasks;
+
+	arm_timer();
 }
 
 void tick_tasks()
 {
-	int id;
-	struct timeval now, interval;
-
-	get_time(&now);
+	struct timeval now;
+	uint64_t expirations;
 
-	for (int i = 0; i < task_count; i++) {
-		if (!tasks[i].id) {
-			continue;
-		}
+	if (timerfd != -1) {
+		read(timerfd, &expirations, sizeof(expirations));
+	}
 
-		struct timeval t = tasks[i].start;
+	/* the timerfd has to fire again for the next deadline */
+	timerclear(&armed);
 
-		interval.tv_sec = tasks[i].interval / 1000;
-		interval.tv_usec = (tasks[i].interval % 1000) * 1000;
+	get_time(&now);
 
-		timeradd(&t, &interval, &t);
+	while (heap_count) {
+		int slot = heap[0];
+		struct Task *t = &tasks[slot];
 
-		if (t.tv_sec * 1000000 + t.tv_usec <
-				now.tv_sec * 1000000 + now.tv_usec) {
-			id = tasks[i].id;
+		if (timercmp(&t->expires, &now, >)) {
+			break;
+		}
 
-			if (!tasks[i].repeat) {
-				tasks[i].id = 0;
-			} else {
-				tasks[i].start = now;
-			}
+		int id = t->id;
+		void (*callback)(int id) = t->callback;
 
-			tasks[i].callback(id);
+		if (t->repeat) {
+			set_deadline(t, &now, 1);
+			sift_down(0);
+		} else {
+			heap_remove(0);
+			t->id = 0;
+			free_slots[free_count++] = slot;
 		}
+
+		callback(id);
 	}
+
+	arm_timer();
 }
 
 void cleanup_tasks()
 {
+	if (timerfd != -1) {
+		close(timerfd);
+		timerfd = -1;
+	}
+
 	if (tasks) {
 		free(tasks);
 	}
+
+	if (heap) {
+		free(heap);
+	}
+
+	if (free_slots) {
+		free(free_slots);
+	}
 }
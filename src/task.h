@@ -22,17 +22,33 @@
 
 #include <sys/time.h>
 
+enum task_mode {
+	TASK_RELATIVE,
+	TASK_ABSOLUTE,
+	TASK_ALIGNED,
+	TASK_MODES
+};
+
+/* The low bits of a task's id are its slot in the task array, the high bits
+ * are a generation counter so that a cancelled id is not reused straight away.
+ */
 struct Task {
 	int id;
+	int gen;
 	int interval;
 	int repeat;
+	enum task_mode mode;
 	void (*callback)(int id);
-	struct timeval start;
+	struct timeval deadline;
+	struct timeval expires;
+	int heap;
 };
 
-int schedule_task(void (*callback)(int id), int interval, int repeat);
+int task_init();
+int parse_task_mode(const char *str);
+int schedule_task(void (*callback)(int id), int interval, int repeat,
+		enum task_mode mode);
 void cancel_task(int id);
-struct timeval get_time_to_next_task();
 void tick_tasks();
 void cleanup_tasks();
 
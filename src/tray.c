@@ -19,6 +19,7 @@
 
 #include "tray.h"
 #include "config.h"
+#include "render.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -155,6 +156,9 @@ void redraw_tray()
 {
 	icons_drawnn = 0;
 
+	/* the tray's divider and background belong to the bar */
+	damage_bar(tray_bar, 0, bars[tray_bar].width);
+
 	for (int i = 0; i < tray_icon_count; i++) {
 		Window embed = tray_icons[i];
 
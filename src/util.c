@@ -21,6 +21,7 @@
 #include "config.h"
 #include "exec.h"
 #include "modules.h"
+#include "render.h"
 #include "task.h"
 #include "window.h"
 #include <stdio.h>
@@ -129,14 +130,12 @@ void blockbar_stringify_color(const color c, char *s)
 
 void resize_block(struct block *blk)
 {
+	/* surfaces are sized to the rendered content by redraw_block */
 	for (int bar = 0; bar < bar_count; bar++) {
 		if (blk->sfc[bar]) {
 			cairo_surface_destroy(blk->sfc[bar]);
+			blk->sfc[bar] = 0;
 		}
-
-		blk->sfc[bar] = cairo_surface_create_similar_image(
-				bars[bar].sfc, CAIRO_FORMAT_ARGB32,
-				bars[bar].width, settings.height.val.INT);
 	}
 }
 
@@ -180,12 +179,14 @@ struct block *create_block(int eachmon)
 	}
 
 	blk->width = malloc(sizeof(int) * bar_count);
+	memset(blk->width, 0, sizeof(int) * bar_count);
 	blk->x = malloc(sizeof(int) * bar_count);
+	memset(blk->x, 0, sizeof(int) * bar_count);
+	blk->dirty = malloc(sizeof(int) * bar_count);
+	memset(blk->dirty, 0, sizeof(int) * bar_count);
 	blk->sfc = malloc(sizeof(cairo_surface_t *) * bar_count);
 	memset(blk->sfc, 0, sizeof(cairo_surface_t *) * bar_count);
 
-	resize_block(blk);
-
 	update_block_task(blk);
 
 	return blk;
@@ -195,6 +196,11 @@ void remove_block(struct block *blk)
 {
 	module_register_block(blk, 0, 0);
 
+	block_kill(blk);
+
+	damage_block(blk);
+	invalidate_layout(-1);
+
 	if (blk->task) {
 		cancel_task(blk->task);
 	}
@@ -219,6 +225,10 @@ void remove_block(struct block *blk)
 
 	free(blk->data);
 
+	if (blk->argv) {
+		free(blk->argv);
+	}
+
 	for (int i = 0; i < property_count; i++) {
 		struct setting *property = &((struct setting *) &(blk->properties))[i];
 
@@ -228,11 +238,14 @@ void remove_block(struct block *blk)
 	}
 
 	for (int i = 0; i < bar_count; i++) {
-		cairo_surface_destroy(blk->sfc[i]);
+		if (blk->sfc[i]) {
+			cairo_surface_destroy(blk->sfc[i]);
+		}
 	}
 
 	free(blk->width);
 	free(blk->x);
+	free(blk->dirty);
 	free(blk->sfc);
 }
 
@@ -269,16 +282,28 @@ void update_block_task(struct block *blk)
 		cancel_task(blk->task);
 	}
 
-	if (blk->properties.interval.val.INT == 0) {
+	if (blk->properties.interval.val.INT == 0 ||
+			blk->properties.persist.val.BOOL) {
 		blk->task = 0;
-	} else {
-		blk->task = schedule_task(block_task_exec,
-				blk->properties.interval.val.INT, 1);
+		return;
+	}
+
+	char *mode = blk->properties.schedule.val.STR;
+
+	if (!mode || !*mode) {
+		mode = settings.schedule.val.STR;
 	}
+
+	int m = parse_task_mode(mode);
+
+	blk->task = schedule_task(block_task_exec,
+			blk->properties.interval.val.INT, 1,
+			m == -1 ? TASK_RELATIVE : m);
 }
 
 void get_time(struct timeval *tv)
 {
-	clock_gettime(CLOCK_MONOTONIC_RAW, (struct timespec *) tv);
+	/* must match the clock of the task timerfd */
+	clock_gettime(CLOCK_BOOTTIME, (struct timespec *) tv);
 	tv->tv_usec /= 1000;
 }
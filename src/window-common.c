@@ -19,32 +19,17 @@
 
 #include "config.h"
 #include "exec.h"
+#include "render.h"
+#include "socket.h"
 #include "window.h"
 
 void click(struct click *cd)
 {
-	for (int i = 0; i < block_count; i++) {
-		struct block *blk = &blocks[i];
+	struct block *blk = block_at(cd->bar, cd->x);
 
-		if (!blk->id) {
-			continue;
-		}
+	notify_click(blk, cd);
 
-		int rendered;
-		if (blk->eachmon) {
-			rendered = blk->data[cd->bar].rendered;
-		} else {
-			rendered = blk->data->rendered;
-		}
-
-		if (!rendered) {
-			continue;
-		}
-
-		if (cd->x > blk->x[cd->bar] &&
-				cd->x < blk->x[cd->bar] + blk->width[cd->bar]) {
-			block_exec(blk, cd);
-			break;
-		}
+	if (blk) {
+		block_exec(blk, cd);
 	}
 }
@@ -22,11 +22,13 @@
 #include "exec.h"
 #include "modules.h"
 #include "render.h"
+#include "socket.h"
 #include "task.h"
 #include "tray.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/shm.h>
 
 #ifndef WAYLAND
 #include <X11/extensions/Xrandr.h>
@@ -53,6 +55,10 @@ static int dndbar;
 
 static int xrr_ev_base, xrr_err_base;
 
+static int shm_available;
+static int shm_error;
+static int shm_completion = -1;
+
 int create_bars()
 {
 	disp = XOpenDisplay(NULL);
@@ -140,13 +146,23 @@ int create_bars()
 		XSelectInput(disp, bar->window,
 				ButtonPressMask | SubstructureNotifyMask | ExposureMask);
 
+		bar->gc = XCreateGC(disp, bar->window, 0, 0);
+		bar->image = 0;
+
+		bar->damage_count = 0;
 		bar->sfc = 0;
 		bar->sfc_visible = 0;
+		bar->chrome = 0;
 		bar->ctx = 0;
 		bar->ctx_visible = 0;
 	}
 
 	XRRQueryExtension(disp, &xrr_ev_base, &xrr_err_base);
+
+	shm_available = XShmQueryExtension(disp);
+	if (shm_available) {
+		shm_completion = XShmGetEventBase(disp) + ShmCompletion;
+	}
 	XRRSelectInput(disp, root, RRScreenChangeNotifyMask);
 
 	XRRFreeScreenResources(res);
@@ -155,8 +171,100 @@ int create_bars()
 	return 0;
 }
 
+static int handle_shm_error(Display *d, XErrorEvent *ev)
+{
+	(void) d;
+	(void) ev;
+
+	shm_error = 1;
+
+	return 0;
+}
+
+/* Creates an image in shared memory that the X server copies to the window,
+ * which fails if the server runs on another machine
+ */
+static int create_shm_image(struct bar *bar)
+{
+	int height = settings.height.val.INT;
+
+	bar->image = XShmCreateImage(disp, visual, 32, ZPixmap, NULL,
+			&bar->shminfo, bar->width, height);
+
+	if (!bar->image) {
+		return 1;
+	}
+
+	if (bar->image->bytes_per_line !=
+			cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, bar->width)) {
+		XDestroyImage(bar->image);
+		bar->image = 0;
+		return 1;
+	}
+
+	bar->shminfo.shmid = shmget(IPC_PRIVATE,
+			bar->image->bytes_per_line * height, IPC_CREAT | 0600);
+
+	if (bar->shminfo.shmid < 0) {
+		perror("shmget");
+		XDestroyImage(bar->image);
+		bar->image = 0;
+		return 1;
+	}
+
+	bar->shminfo.shmaddr = shmat(bar->shminfo.shmid, 0, 0);
+	bar->shminfo.readOnly = True;
+
+	if (bar->shminfo.shmaddr == (void *) -1) {
+		perror("shmat");
+		shmctl(bar->shminfo.shmid, IPC_RMID, 0);
+		XDestroyImage(bar->image);
+		bar->image = 0;
+		return 1;
+	}
+
+	bar->image->data = bar->shminfo.shmaddr;
+
+	shm_error = 0;
+	XErrorHandler handler = XSetErrorHandler(handle_shm_error);
+	XShmAttach(disp, &bar->shminfo);
+	XSync(disp, False);
+	XSetErrorHandler(handler);
+
+	/* the segment is freed once both sides have detached from it */
+	shmctl(bar->shminfo.shmid, IPC_RMID, 0);
+
+	if (shm_error) {
+		shmdt(bar->shminfo.shmaddr);
+		bar->image->data = 0;
+		XDestroyImage(bar->image);
+		bar->image = 0;
+		return 1;
+	}
+
+	bar->shm_serial = 0;
+
+	return 0;
+}
+
+static void destroy_shm_image(struct bar *bar)
+{
+	if (!bar->image) {
+		return;
+	}
+
+	XShmDetach(disp, &bar->shminfo);
+	shmdt(bar->shminfo.shmaddr);
+
+	bar->image->data = 0;
+	XDestroyImage(bar->image);
+	bar->image = 0;
+}
+
 void update_geom()
 {
+	invalidate_chrome();
+
 	int s = DefaultScreen(disp);
 	Window root = RootWindow(disp, s);
 
@@ -216,14 +324,35 @@ void update_geom()
 			cairo_destroy(bar->ctx_visible);
 		}
 
-		bar->sfc_visible = cairo_xlib_surface_create(disp, bar->window,
-				visual, bar->width, settings.height.val.INT);
+		x_wait_redraw();
+		destroy_shm_image(bar);
+
+		if (shm_available && create_shm_image(bar) != 0) {
+			fprintf(stderr, "MIT-SHM is not usable, "
+					"bars are sent over the connection instead\n");
+			shm_available = 0;
+		}
 
-		bar->sfc = cairo_surface_create_similar_image(bar->sfc_visible,
-				CAIRO_FORMAT_ARGB32, bar->width, settings.height.val.INT);
+		if (bar->image) {
+			bar->sfc_visible = 0;
+			bar->ctx_visible = 0;
+
+			bar->sfc = cairo_image_surface_create_for_data(
+					(unsigned char *) bar->image->data, CAIRO_FORMAT_ARGB32,
+					bar->width, settings.height.val.INT,
+					bar->image->bytes_per_line);
+		} else {
+			bar->sfc_visible = cairo_xlib_surface_create(disp, bar->window,
+					visual, bar->width, settings.height.val.INT);
+			bar->ctx_visible = cairo_create(bar->sfc_visible);
+
+			bar->sfc = cairo_surface_create_similar_image(bar->sfc_visible,
+					CAIRO_FORMAT_ARGB32, bar->width, settings.height.val.INT);
+		}
 
 		bar->ctx = cairo_create(bar->sfc);
-		bar->ctx_visible = cairo_create(bar->sfc_visible);
+
+		damage_bar(b, 0, bar->width);
 
 		long geom [12] = {0};
 		int height = settings.height.val.INT + settings.marginvert.val.INT * 2;
@@ -321,7 +450,7 @@ static void handle_xdnd_event(XEvent *ev)
 				cancel_task(taskid);
 			}
 
-			taskid = schedule_task(&dnd_task, 500, 0);
+			taskid = schedule_task(&dnd_task, 500, 0, TASK_RELATIVE);
 		}
 
 		XEvent resp;
@@ -340,11 +469,21 @@ static void handle_xdnd_event(XEvent *ev)
 	}
 }
 
-void poll_events()
+int poll_events()
 {
+	int dirty = 0;
+
 	XEvent ev;
 	while (XPending(disp)) {
 		XNextEvent(disp, &ev);
+
+		/* a copy to a bar has finished, which changes nothing on it */
+		if (ev.type == shm_completion) {
+			continue;
+		}
+
+		dirty = 1;
+
 		switch (ev.type) {
 			case ButtonPress:
 			{
@@ -375,6 +514,15 @@ void poll_events()
 					handle_xdnd_event(&ev);
 				}
 				break;
+			case Expose:
+				for (int bar = 0; bar < bar_count; bar++) {
+					if (bars[bar].window == ev.xexpose.window) {
+						damage_bar(bar, ev.xexpose.x,
+								ev.xexpose.width);
+						break;
+					}
+				}
+				break;
 			case ReparentNotify:
 			case DestroyNotify:
 				handle_destroy_event(&ev);
@@ -382,37 +530,91 @@ void poll_events()
 			default:
 				if (ev.type == xrr_ev_base + RRScreenChangeNotify) {
 					update_geom();
-
-					for (int i = 0; i < block_count; i++) {
-						struct block *blk = &blocks[i];
-
-						if (blk->id) {
-							redraw_block(blk);
-						}
-					}
+					redraw_all_blocks();
 					redraw();
 					redraw_tray();
+					notify_outputs();
 				}
 		}
 	}
+
+	return dirty;
 }
 
 void cleanup_bars()
 {
+	invalidate_chrome();
+
 	for (int i = 0; i < bar_count; i++) {
 		struct bar *bar = &bars[i];
 
 		free(bar->output);
 		cairo_surface_destroy(bar->sfc);
-		cairo_surface_destroy(bar->sfc_visible);
 		cairo_destroy(bar->ctx);
-		cairo_destroy(bar->ctx_visible);
+
+		if (bar->sfc_visible) {
+			cairo_surface_destroy(bar->sfc_visible);
+			cairo_destroy(bar->ctx_visible);
+		}
+
+		destroy_shm_image(bar);
+		XFreeGC(disp, bar->gc);
 		XDestroyWindow(disp, bar->window);
 	}
 
 	free(bars);
 }
 
+void x_redraw(struct bar *bar)
+{
+	int height = settings.height.val.INT;
+
+	if (!bar->image) {
+		cairo_t *ctx = bar->ctx_visible;
+		cairo_save(ctx);
+
+		for (int i = 0; i < bar->damage_count; i++) {
+			cairo_rectangle(ctx, bar->damage[i].x, 0, bar->damage[i].width,
+					height);
+		}
+
+		cairo_clip(ctx);
+		cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(ctx, bar->sfc, 0, 0);
+		cairo_paint(ctx);
+		cairo_restore(ctx);
+
+		return;
+	}
+
+	cairo_surface_flush(bar->sfc);
+
+	for (int i = 0; i < bar->damage_count; i++) {
+		struct damage *d = &bar->damage[i];
+
+		XShmPutImage(disp, bar->window, bar->gc, bar->image, d->x, 0,
+				d->x, 0, d->width, height, True);
+	}
+
+	bar->shm_serial = NextRequest(disp) - 1;
+}
+
+/*
+ * Waits until the server has read the images of the bars before they are
+ * drawn to again. The completion events of the last copies have usually
+ * arrived by the next redraw, so this rarely needs a round trip.
+ */
+void x_wait_redraw()
+{
+	for (int i = 0; i < bar_count; i++) {
+		if (bars[i].image &&
+				LastKnownRequestProcessed(disp) < bars[i].shm_serial) {
+			XSync(disp, False);
+			return;
+		}
+	}
+}
+
 int blockbar_get_bar_width(int bar)
 {
 	return bars[bar].width;
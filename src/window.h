@@ -21,16 +21,58 @@
 #define WINDOW_H
 
 #include "types.h"
+#ifdef HEADLESS
+#include <cairo.h>
+#else
 #include <cairo/cairo-xlib.h>
+#endif
 #ifdef WAYLAND
 #include <wayland-client.h>
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
-#else
+#elif !defined(HEADLESS)
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 #endif
 
 #ifdef WAYLAND
-static const char shm_fmt [] = "/blockbar-shm-xxxxxx";
+#define MAX_BUFFERS 3
+#endif
+
+#define MAX_DAMAGE 16
+
+/* A part of a bar, spanning its height, that has changed since it was last
+ * presented
+ */
+struct damage {
+	int x;
+	int width;
+};
+
+#ifdef WAYLAND
+/* A buffer that is shared with the compositor, which may read from it until
+ * it is released
+ */
+struct shm_buffer {
+	struct wl_buffer *buffer;
+	cairo_surface_t *sfc;
+
+	/* the part of the shm pool, which every bar shares, that is used */
+	size_t offset;
+	size_t size;
+	int busy;
+
+	/* set when the bar was resized while the compositor was reading from
+	 * the buffer, which is destroyed when it is released
+	 */
+	int retired;
+
+	/* the parts of the bar that were presented from other buffers since this
+	 * one was last presented
+	 */
+	struct damage stale [MAX_DAMAGE];
+	int stale_count;
+};
 #endif
 
 struct bar {
@@ -39,15 +81,30 @@ struct bar {
 	struct wl_surface *surface;
 	struct zwlr_layer_surface_v1 *layer_surface;
 
-	struct wl_buffer *buffer;
-	void *map;
-	int fd;
-	char shm_path [sizeof(shm_fmt) / sizeof(*shm_fmt)];
+	struct shm_buffer buffers [MAX_BUFFERS];
+	int buffer_count;
+
+	/* set while a frame is drawn, presenting waits until it is done */
+	struct wl_callback *frame;
+	struct damage pending [MAX_DAMAGE];
+	int pending_count;
 
 	int output_rotate;
 	int output_width;
+#elif defined(HEADLESS)
+	int output_x;
+	int output_width;
+	int frame;
 #else
 	Window window;
+	GC gc;
+
+	/* with MIT-SHM the bar's surface is shared with the X server, which
+	 * reads from it until the request with shm_serial is processed
+	 */
+	XImage *image;
+	XShmSegmentInfo shminfo;
+	unsigned long shm_serial;
 #endif
 	int x;
 	int width;
@@ -55,7 +112,13 @@ struct bar {
 
 	cairo_surface_t *sfc;
 	cairo_t *ctx;
-#ifndef WAYLAND
+
+	/* the background and border, drawn when the bar is first redrawn */
+	cairo_surface_t *chrome;
+
+	struct damage damage [MAX_DAMAGE];
+	int damage_count;
+#if !defined(WAYLAND) && !defined(HEADLESS)
 	cairo_surface_t *sfc_visible;
 	cairo_t *ctx_visible;
 #endif
@@ -63,7 +126,7 @@ struct bar {
 
 #ifdef WAYLAND
 extern struct wl_display *disp;
-#else
+#elif !defined(HEADLESS)
 extern Display *disp;
 #endif
 
@@ -72,7 +135,10 @@ extern struct bar *bars;
 
 int create_bars();
 void update_geom();
-void poll_events();
+/* Returns nonzero if an event was handled that the bars may need to be
+ * redrawn for
+ */
+int poll_events();
 void cleanup_bars();
 
 void click(struct click *cd);
@@ -81,4 +147,13 @@ void click(struct click *cd);
 void wl_redraw(struct bar *bar);
 #endif
 
+#ifdef HEADLESS
+void headless_redraw(struct bar *bar);
+#endif
+
+#if !defined(WAYLAND) && !defined(HEADLESS)
+void x_redraw(struct bar *bar);
+void x_wait_redraw();
+#endif
+
 #endif /* WINDOW_H */
@@ -17,14 +17,19 @@
  * 3. This notice may not be removed or altered from any source distribution.
  */
 
+#define _GNU_SOURCE
+
 #include "window.h"
 #include "config.h"
 #include "exec.h"
 #include "modules.h"
 #include "render.h"
+#include "socket.h"
+#include "task.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/input-event-codes.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,9 +41,18 @@
 struct wl_display *disp = NULL;
 
 static struct wl_compositor *compositor = NULL;
+static uint32_t compositor_version;
 static struct wl_shm *shm = NULL;
 static struct zwlr_layer_shell_v1 *layer_shell = NULL;
 
+/* one pool is shared by the buffers of every bar, it grows but never shrinks
+ * and the space of destroyed buffers is used again
+ */
+static int shm_fd = -1;
+static void *shm_map = NULL;
+static size_t shm_size;
+static struct wl_shm_pool *shm_pool = NULL;
+
 static struct wl_seat *seat = NULL;
 static struct wl_pointer *pointer = NULL;
 
@@ -52,6 +66,16 @@ static uint32_t axis_time [2] = {0};
 #define SCROLL_TIMEOUT 100
 #define SCROLL_THRESHOLD 10000
 
+/* how long to wait before trying again to get a buffer for a bar */
+#define RETRY_INTERVAL 1000
+
+static int retry_taskid = 0;
+
+/* the number of dispatched events that were about presenting, which don't
+ * need a redraw
+ */
+static int presentation_events;
+
 int bar_count;
 struct bar *bars;
 
@@ -85,15 +109,9 @@ static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
 
 	if (bar->sfc) {
 		update_geom();
-
-		for (int i = 0; i < block_count; i++) {
-			struct block *blk = &blocks[i];
-
-			if (blk->id) {
-				redraw_block(blk);
-			}
-		}
+		redraw_all_blocks();
 		redraw();
+		notify_outputs();
 	}
 }
 
@@ -331,7 +349,9 @@ static void handle_global(void *data, struct wl_registry *registry, uint32_t id,
 	(void) data;
 
 	if (strcmp(interface, wl_compositor_interface.name) == 0) {
-		compositor = wl_registry_bind(registry, id, &wl_compositor_interface, 1);
+		compositor_version = version < 4 ? version : 4;
+		compositor = wl_registry_bind(registry, id, &wl_compositor_interface,
+				compositor_version);
 	} else if (strcmp(interface, wl_seat_interface.name) == 0) {
 		seat = wl_registry_bind(registry, id, &wl_seat_interface, 5);
 		wl_seat_add_listener(seat, &seat_listener, NULL);
@@ -419,72 +439,389 @@ static int wl_init()
 	return 0;
 }
 
-static int create_shm(struct bar *bar, int size)
+static int compare_offsets(const void *a, const void *b)
 {
-	int n = 0;
-	int fd;
+	const struct shm_buffer *x = *(const struct shm_buffer **) a;
+	const struct shm_buffer *y = *(const struct shm_buffer **) b;
 
-	strcpy(bar->shm_path, shm_fmt);
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
 
-	do {
-		snprintf(bar->shm_path + strlen(shm_fmt) - 6, 7, "%06d", n++);
-		errno = 0;
-		fd = shm_open(bar->shm_path, O_RDWR | O_CREAT | O_EXCL, 0600);
+/* Grows the pool, which only moves the mapping if it can't be extended */
+static int grow_shm(size_t size)
+{
+	if (shm_fd == -1) {
+		shm_fd = memfd_create("blockbar-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
 
-		if (n > 999999) {
-			fprintf(stderr, "shm_open failed\n");
-			return -1;
+		if (shm_fd < 0) {
+			perror("memfd_create");
+			return 1;
 		}
-	} while (errno == EEXIST);
 
-	if (fd < 0) {
-		perror("shm_open");
-		return -1;
+		/* the compositor can rely on the pool never getting smaller */
+		if (fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+			perror("fcntl");
+		}
 	}
 
-	if (ftruncate(fd, size) < 0) {
+	if (ftruncate(shm_fd, size) < 0) {
 		perror("ftruncate");
-		fprintf(stderr, "%d %d\n", fd, size);
-		close(fd);
-		return -1;
+		return 1;
 	}
 
-	return fd;
+	void *map;
+
+	if (shm_map) {
+		map = mremap(shm_map, shm_size, size, MREMAP_MAYMOVE);
+	} else {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	}
+
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (shm_pool) {
+		wl_shm_pool_resize(shm_pool, size);
+	} else {
+		shm_pool = wl_shm_create_pool(shm, shm_fd, size);
+	}
+
+	int moved = shm_map && map != shm_map;
+
+	shm_map = map;
+	shm_size = size;
+
+	if (!moved) {
+		return 0;
+	}
+
+	/* the pixels stay where they are in the pool, only the surfaces move */
+	for (int i = 0; i < bar_count; i++) {
+		struct bar *bar = &bars[i];
+
+		for (int j = 0; j < bar->buffer_count; j++) {
+			struct shm_buffer *buf = &bar->buffers[j];
+
+			if (buf->retired) {
+				continue;
+			}
+
+			cairo_surface_destroy(buf->sfc);
+			buf->sfc = cairo_image_surface_create_for_data(
+					(unsigned char *) shm_map + buf->offset,
+					CAIRO_FORMAT_ARGB32, bar->width, settings.height.val.INT,
+					cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32,
+						bar->width));
+		}
+	}
+
+	return 0;
 }
 
-static struct wl_buffer *create_buffer(struct bar *bar, int height)
+/* Finds the first gap between buffers that fits, growing the pool if there
+ * isn't one
+ */
+static int alloc_shm(size_t size, size_t *offset)
 {
-	int stride = 4 * bar->width;
-	int size = stride * height;
-	bar->fd = create_shm(bar, size);
+	struct shm_buffer *used [bar_count * MAX_BUFFERS];
+	int count = 0;
 
-	if (bar->fd < 0) {
+	for (int i = 0; i < bar_count; i++) {
+		for (int j = 0; j < bars[i].buffer_count; j++) {
+			used[count++] = &bars[i].buffers[j];
+		}
+	}
+
+	qsort(used, count, sizeof(*used), compare_offsets);
+
+	size_t start = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (used[i]->offset - start >= size) {
+			break;
+		}
+
+		start = used[i]->offset + used[i]->size;
+	}
+
+	if (start + size > shm_size) {
+		size_t new_size = shm_size ? shm_size : size;
+
+		while (new_size < start + size) {
+			new_size *= 2;
+		}
+
+		if (grow_shm(new_size) != 0) {
+			return 1;
+		}
+	}
+
+	*offset = start;
+
+	return 0;
+}
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer);
+
+static const struct wl_buffer_listener buffer_listener = {
+	buffer_release
+};
+
+static int create_buffer(struct bar *bar, struct shm_buffer *buf)
+{
+	int height = settings.height.val.INT;
+	int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, bar->width);
+	buf->size = (size_t) stride * height;
+
+	if (alloc_shm(buf->size, &buf->offset) != 0) {
 		fprintf(stderr, "Failed to create shm\n");
+		return 1;
+	}
+
+	buf->buffer = wl_shm_pool_create_buffer(shm_pool, buf->offset,
+			bar->width, height, stride, WL_SHM_FORMAT_ARGB8888);
+
+	wl_buffer_add_listener(buf->buffer, &buffer_listener,
+			(void *) (long) (bar - bars));
+
+	buf->sfc = cairo_image_surface_create_for_data(
+			(unsigned char *) shm_map + buf->offset,
+			CAIRO_FORMAT_ARGB32, bar->width, height, stride);
+	buf->busy = 0;
+	buf->retired = 0;
+
+	/* nothing has been copied to a new buffer yet */
+	buf->stale[0].x = 0;
+	buf->stale[0].width = bar->width;
+	buf->stale_count = 1;
+
+	return 0;
+}
+
+/* Destroys a buffer, which gives its part of the pool back */
+static void destroy_buffer(struct bar *bar, int i)
+{
+	struct shm_buffer *buf = &bar->buffers[i];
+
+	if (!buf->retired) {
+		cairo_surface_destroy(buf->sfc);
+	}
+
+	wl_buffer_destroy(buf->buffer);
+
+	bar->buffers[i] = bar->buffers[--bar->buffer_count];
+}
+
+/* Destroys the buffers of a bar that the compositor isn't reading from. The
+ * others keep their part of the pool until they are released.
+ */
+static void retire_buffers(struct bar *bar)
+{
+	for (int i = bar->buffer_count - 1; i >= 0; i--) {
+		struct shm_buffer *buf = &bar->buffers[i];
+
+		if (!buf->busy) {
+			destroy_buffer(bar, i);
+		} else if (!buf->retired) {
+			cairo_surface_destroy(buf->sfc);
+			buf->sfc = 0;
+			buf->retired = 1;
+		}
+	}
+}
+
+/* Returns a buffer that the compositor isn't reading from, or 0 if every
+ * buffer is in use
+ */
+static struct shm_buffer *get_buffer(struct bar *bar)
+{
+	for (int i = 0; i < bar->buffer_count; i++) {
+		if (!bar->buffers[i].busy) {
+			return &bar->buffers[i];
+		}
+	}
+
+	if (bar->buffer_count == MAX_BUFFERS) {
 		return 0;
 	}
 
-	bar->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, bar->fd, 0);
-	if (bar->map == MAP_FAILED) {
-		perror("mmap\n");
-		close(bar->fd);
+	struct shm_buffer *buf = &bar->buffers[bar->buffer_count];
+
+	if (create_buffer(bar, buf) != 0) {
 		return 0;
 	}
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, bar->fd, size);
-	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, bar->width,
-			height, stride, WL_SHM_FORMAT_ARGB8888);
-	wl_shm_pool_destroy(pool);
+	bar->buffer_count++;
+
+	return buf;
+}
 
-	memset(bar->map, 0, size);
+/* Adds a span to a list of damage, merging the list into one span when full */
+static void add_damage(struct damage *list, int *count, int x, int width)
+{
+	if (*count == MAX_DAMAGE) {
+		int start = list[0].x;
+		int end = list[0].x + list[0].width;
+
+		for (int i = 1; i < *count; i++) {
+			if (list[i].x < start) {
+				start = list[i].x;
+			}
+
+			if (list[i].x + list[i].width > end) {
+				end = list[i].x + list[i].width;
+			}
+		}
 
-	return buffer;
+		list[0].x = start;
+		list[0].width = end - start;
+		*count = 1;
+	}
+
+	list[*count].x = x;
+	list[*count].width = width;
+	(*count)++;
+}
+
+static void frame_done(void *data, struct wl_callback *callback,
+		uint32_t time);
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
+static void present(struct bar *bar);
+
+static void retry_present(int id)
+{
+	if (id != retry_taskid) {
+		return;
+	}
+
+	retry_taskid = 0;
+
+	for (int i = 0; i < bar_count; i++) {
+		present(&bars[i]);
+	}
+}
+
+/*
+ * Commits the pending damage once the compositor has drawn the last frame, so
+ * that any number of redraws within a frame are shown with a single commit.
+ */
+static void present(struct bar *bar)
+{
+	if (bar->frame || bar->pending_count == 0) {
+		return;
+	}
+
+	struct shm_buffer *buf = get_buffer(bar);
+
+	if (!buf) {
+		/* this is tried again when a buffer is released, but if none is
+		 * busy one couldn't be created and the damage stays pending
+		 */
+		for (int i = 0; i < bar->buffer_count; i++) {
+			if (bar->buffers[i].busy) {
+				return;
+			}
+		}
+
+		if (!retry_taskid) {
+			retry_taskid = schedule_task(&retry_present, RETRY_INTERVAL, 0,
+					TASK_RELATIVE);
+		}
+
+		return;
+	}
+
+	for (int i = 0; i < bar->buffer_count; i++) {
+		struct shm_buffer *b = &bar->buffers[i];
+
+		for (int j = 0; j < bar->pending_count; j++) {
+			add_damage(b->stale, &b->stale_count, bar->pending[j].x,
+					bar->pending[j].width);
+		}
+	}
+
+	cairo_t *ctx = cairo_create(buf->sfc);
+
+	for (int i = 0; i < buf->stale_count; i++) {
+		cairo_rectangle(ctx, buf->stale[i].x, 0, buf->stale[i].width,
+				settings.height.val.INT);
+	}
+
+	cairo_clip(ctx);
+	cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(ctx, bar->sfc, 0, 0);
+	cairo_paint(ctx);
+	cairo_destroy(ctx);
+
+	cairo_surface_flush(buf->sfc);
+	buf->stale_count = 0;
+
+	wl_surface_attach(bar->surface, buf->buffer, 0, 0);
+
+	for (int i = 0; i < bar->pending_count; i++) {
+		struct damage *d = &bar->pending[i];
+
+		if (compositor_version >= WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION) {
+			wl_surface_damage_buffer(bar->surface, d->x, 0, d->width,
+					settings.height.val.INT);
+		} else {
+			wl_surface_damage(bar->surface, d->x, 0, d->width,
+					settings.height.val.INT);
+		}
+	}
+
+	bar->pending_count = 0;
+
+	bar->frame = wl_surface_frame(bar->surface);
+	wl_callback_add_listener(bar->frame, &frame_listener,
+			(void *) (long) (bar - bars));
+
+	wl_surface_commit(bar->surface);
+	buf->busy = 1;
+
+	wl_display_flush(disp);
+}
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct bar *bar = &bars[(long) data];
+
+	presentation_events++;
+
+	for (int i = 0; i < bar->buffer_count; i++) {
+		if (bar->buffers[i].buffer == wl_buffer) {
+			if (bar->buffers[i].retired) {
+				destroy_buffer(bar, i);
+			} else {
+				bar->buffers[i].busy = 0;
+			}
+
+			break;
+		}
+	}
+
+	present(bar);
 }
 
-static void close_buffer(struct bar *bar)
+static void frame_done(void *data, struct wl_callback *callback,
+		uint32_t time)
 {
-	wl_buffer_destroy(bar->buffer);
-	shm_unlink(bar->shm_path);
-	close(bar->fd);
+	(void) time;
+
+	struct bar *bar = &bars[(long) data];
+
+	presentation_events++;
+
+	wl_callback_destroy(callback);
+	bar->frame = NULL;
+
+	present(bar);
 }
 
 int create_bars()
@@ -522,6 +859,8 @@ int create_bars()
 
 void update_geom()
 {
+	invalidate_chrome();
+
 	for (int i = 0; i < bar_count; i++) {
 		struct bar *bar = &bars[i];
 
@@ -549,24 +888,14 @@ void update_geom()
 			cairo_destroy(bar->ctx);
 		}
 
-		wl_surface_attach(bar->surface, NULL, 0, 0);
-
-		if (bar->buffer) {
-			close_buffer(bar);
-		}
-
-		bar->buffer = create_buffer(bar, settings.height.val.INT);
-		if (!bar->buffer) {
-
-			exit(1);
-		}
-
-		wl_surface_attach(bar->surface, bar->buffer, 0, 0);
-		wl_surface_commit(bar->surface);
+		/* buffers of the new size are created when the bar is presented,
+		 * which happens with the redraw that follows
+		 */
+		retire_buffers(bar);
+		bar->pending_count = 0;
 
-		bar->sfc = cairo_image_surface_create_for_data(bar->map,
-				CAIRO_FORMAT_ARGB32, bar->width, settings.height.val.INT,
-				cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, bar->width));
+		bar->sfc = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+				bar->width, settings.height.val.INT);
 
 		if (cairo_surface_status(bar->sfc) != CAIRO_STATUS_SUCCESS) {
 			fprintf(stderr, "Failed to create cairo surface\n");
@@ -575,7 +904,7 @@ void update_geom()
 
 		bar->ctx = cairo_create(bar->sfc);
 
-		wl_redraw(bar);
+		damage_bar(i, 0, bar->width);
 	}
 
 	for (int i = 0; i < block_count; i++) {
@@ -597,32 +926,69 @@ void update_geom()
 
 void wl_redraw(struct bar *bar)
 {
-	cairo_surface_flush(bar->sfc);
-
-	wl_surface_attach(bar->surface, bar->buffer, 0, 0);
-	wl_surface_damage(bar->surface, 0, 0, bar->width, settings.height.val.INT);
-	wl_surface_commit(bar->surface);
+	for (int i = 0; i < bar->damage_count; i++) {
+		add_damage(bar->pending, &bar->pending_count, bar->damage[i].x,
+				bar->damage[i].width);
+	}
 
-	wl_display_dispatch(disp);
+	present(bar);
 }
 
-void poll_events()
+int poll_events()
 {
-	if (wl_display_dispatch_pending(disp) == -1) {
+	int dispatched = 0;
+	int n;
+
+	presentation_events = 0;
+
+	/* the display may not be readable, so events are read without blocking */
+	while (wl_display_prepare_read(disp) != 0) {
+		if ((n = wl_display_dispatch_pending(disp)) == -1) {
+			fprintf(stderr, "wl_display_dispatch failed\n");
+			exit(1);
+		}
+
+		dispatched += n;
+	}
+
+	wl_display_flush(disp);
+
+	struct pollfd pfd = {
+		.fd = wl_display_get_fd(disp),
+		.events = POLLIN
+	};
+
+	if (poll(&pfd, 1, 0) > 0) {
+		if (wl_display_read_events(disp) == -1) {
+			fprintf(stderr, "wl_display_read_events failed\n");
+			exit(1);
+		}
+	} else {
+		wl_display_cancel_read(disp);
+	}
+
+	if ((n = wl_display_dispatch_pending(disp)) == -1) {
 		fprintf(stderr, "wl_display_dispatch failed\n");
 		exit(1);
 	}
+
+	return dispatched + n > presentation_events;
 }
 
 void cleanup_bars()
 {
+	invalidate_chrome();
+
 	for (int i = 0; i < bar_count; i++) {
 		struct bar *bar = &bars[i];
 
 		free(bar->output);
 		cairo_surface_destroy(bar->sfc);
 		cairo_destroy(bar->ctx);
-		close_buffer(bar);
+
+		if (bar->frame) {
+			wl_callback_destroy(bar->frame);
+		}
 
 		if (pointer) {
 			wl_pointer_release(pointer);
@@ -630,6 +996,17 @@ void cleanup_bars()
 
 		zwlr_layer_surface_v1_destroy(bar->layer_surface);
 		wl_surface_destroy(bar->surface);
+
+		/* nothing reads from the buffers once the surface is gone */
+		while (bar->buffer_count) {
+			destroy_buffer(bar, 0);
+		}
+	}
+
+	if (shm_pool) {
+		wl_shm_pool_destroy(shm_pool);
+		munmap(shm_map, shm_size);
+		close(shm_fd);
 	}
 
 	free(bars);